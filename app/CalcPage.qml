@@ -76,6 +76,8 @@ Page {
             y: skinImageId.lcdY
             width: skinId.lcdW * skinImageId.scaleX
             height: skinId.lcdH * skinImageId.scaleY
+            lcdBlack: skinId.lcdBlack
+            lcdWhite: skinId.lcdWhite
         }
         MouseArea {
             anchors.fill: parent
@@ -0,0 +1,400 @@
+/*!
+    \file main.cpp
+    \brief Headless front-end to the emulation core
+
+    Loads a ROM (and optionally a saved state), loads variables straight
+    into memory or sends link files, injects key presses, runs for a number
+    of cycles or until a condition is met and finally receives variables
+    and dumps the LCD and/or the state. Given several states, it does all
+    of that for each of them with a single calc and link session. No GUI
+    library is involved so thousands of these can run on a build server.
+*/
+
+#include "calc.h"
+#include "calclink.h"
+#include "linktransfer.h"
+#include "transfermanager.h"
+
+#include "scancodes.h"
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QCommandLineParser>
+#include <QStringList>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+
+#include <stdio.h>
+
+struct KeyName
+{
+    const char *name;
+    int code;
+};
+
+static const KeyName key_names[] = {
+    { "DOWN", TILEM_KEY_DOWN },
+    { "LEFT", TILEM_KEY_LEFT },
+    { "RIGHT", TILEM_KEY_RIGHT },
+    { "UP", TILEM_KEY_UP },
+    { "ENTER", TILEM_KEY_ENTER },
+    { "ADD", TILEM_KEY_ADD },
+    { "SUB", TILEM_KEY_SUB },
+    { "MUL", TILEM_KEY_MUL },
+    { "DIV", TILEM_KEY_DIV },
+    { "POWER", TILEM_KEY_POWER },
+    { "CLEAR", TILEM_KEY_CLEAR },
+    { "CHS", TILEM_KEY_CHS },
+    { "3", TILEM_KEY_3 },
+    { "6", TILEM_KEY_6 },
+    { "9", TILEM_KEY_9 },
+    { "RPAREN", TILEM_KEY_RPAREN },
+    { "TAN", TILEM_KEY_TAN },
+    { "VARS", TILEM_KEY_VARS },
+    { "DECPNT", TILEM_KEY_DECPNT },
+    { "2", TILEM_KEY_2 },
+    { "5", TILEM_KEY_5 },
+    { "8", TILEM_KEY_8 },
+    { "LPAREN", TILEM_KEY_LPAREN },
+    { "COS", TILEM_KEY_COS },
+    { "PRGM", TILEM_KEY_PRGM },
+    { "STAT", TILEM_KEY_STAT },
+    { "0", TILEM_KEY_0 },
+    { "1", TILEM_KEY_1 },
+    { "4", TILEM_KEY_4 },
+    { "7", TILEM_KEY_7 },
+    { "COMMA", TILEM_KEY_COMMA },
+    { "SIN", TILEM_KEY_SIN },
+    { "MATRIX", TILEM_KEY_MATRIX },
+    { "GRAPHVAR", TILEM_KEY_GRAPHVAR },
+    { "ON", TILEM_KEY_ON },
+    { "STORE", TILEM_KEY_STORE },
+    { "LN", TILEM_KEY_LN },
+    { "LOG", TILEM_KEY_LOG },
+    { "SQUARE", TILEM_KEY_SQUARE },
+    { "RECIP", TILEM_KEY_RECIP },
+    { "MATH", TILEM_KEY_MATH },
+    { "ALPHA", TILEM_KEY_ALPHA },
+    { "GRAPH", TILEM_KEY_GRAPH },
+    { "TRACE", TILEM_KEY_TRACE },
+    { "ZOOM", TILEM_KEY_ZOOM },
+    { "WINDOW", TILEM_KEY_WINDOW },
+    { "YEQU", TILEM_KEY_YEQU },
+    { "2ND", TILEM_KEY_2ND },
+    { "MODE", TILEM_KEY_MODE },
+    { "DEL", TILEM_KEY_DEL },
+    { 0, 0 }
+};
+
+/**
+ * @brief Translate a key name (ENTER, 2ND, ...) or a raw scancode into a scancode
+ *
+ * @return the scancode, -1 if unknown
+ */
+static int key_code(const QString& key)
+{
+    bool ok;
+    int code = key.toInt(&ok, 0);
+
+    if ( ok )
+        return code;
+
+    for ( const KeyName *k = key_names; k->name; ++k )
+        if ( !key.compare(QLatin1String(k->name), Qt::CaseInsensitive) )
+            return k->code;
+
+    return -1;
+}
+
+/**
+ * @brief Write the plain LCD content as a binary PBM image
+ */
+static bool dump_lcd(Calc& calc, const QString& file)
+{
+    QFile f(file);
+
+    if ( !f.open(QFile::WriteOnly) )
+    {
+        fprintf(stderr, "Unable to write LCD dump \"%s\"\n", qPrintable(file));
+        return false;
+    }
+
+    // PBM (P4) uses the same layout as the LCD : 1bpp, MSB first, 1 is black
+    f.write(QString("P4\n%1 %2\n").arg(calc.lcdWidth()).arg(calc.lcdHeight()).toLatin1());
+    f.write(calc.lcdBits());
+
+    return true;
+}
+
+/**
+ * @brief Output file for a state : with several states, the state name goes before the suffix
+ */
+static QString state_file(const QString& file, const QString& state, bool batch)
+{
+    if ( !batch )
+        return file;
+
+    QFileInfo info(file);
+    QString name = info.completeBaseName() + "-" + QFileInfo(state).completeBaseName();
+
+    if ( !info.suffix().isEmpty() )
+        name += "." + info.suffix();
+
+    return QDir(info.path()).filePath(name);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("tilem-cli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless TilEm calculator emulator");
+    parser.addHelpOption();
+
+    QCommandLineOption romOption(QStringList() << "r" << "rom", "ROM image to load.", "file");
+    QCommandLineOption stateOption(QStringList() << "s" << "state", "Saved state to restore (repeatable : everything is done once per state, output files get the state name).", "file");
+    QCommandLineOption sendOption(QStringList() << "f" << "send", "Send a file through the link port (repeatable).", "file");
+    QCommandLineOption injectOption(QStringList() << "i" << "inject", "Write the variables of a file straight into memory, falling back to --send when they cannot be (repeatable).", "file");
+    QCommandLineOption keyOption(QStringList() << "k" << "key", "Press and release a key, by name (ENTER, 2ND, ...) or scancode (repeatable).", "key");
+    QCommandLineOption keyDelayOption("key-delay", "Emulated time a key is held, and then released, in ms (default 100).", "ms", "100");
+    QCommandLineOption cyclesOption(QStringList() << "c" << "cycles", "Number of clock cycles to run.", "n");
+    QCommandLineOption timeOption(QStringList() << "t" << "time", "Emulated time to run, in ms.", "ms");
+    QCommandLineOption untilPcOption("until-pc", "Stop when the CPU executes this address.", "addr");
+    QCommandLineOption untilIdleOption("until-idle", "Stop as soon as the CPU is halted waiting for an interrupt.");
+    QCommandLineOption lcdOption(QStringList() << "l" << "lcd", "Dump the LCD to a PBM image when done.", "file");
+    QCommandLineOption saveOption(QStringList() << "o" << "save", "Save ROM and state (next to it, as .sav) when done.", "file");
+    QCommandLineOption dumpOption(QStringList() << "d" << "dump", "Receive the variables of the calc into this directory when done.", "dir");
+    QCommandLineOption dumpFilterOption("dump-filter", "Only dump files matching this wildcard, e.g. \"*.8xp\" for programs (default *).", "pattern", "*");
+    QCommandLineOption dumpAppsOption("dump-apps", "Dump flash applications too.");
+    QCommandLineOption dumpBackupOption("dump-backup", "Dump a backup too.");
+    QCommandLineOption exportOption("export-lcd", "Publish gray LCD frames into this POSIX shared memory object while running.", "name");
+
+    parser.addOption(romOption);
+    parser.addOption(stateOption);
+    parser.addOption(sendOption);
+    parser.addOption(injectOption);
+    parser.addOption(keyOption);
+    parser.addOption(keyDelayOption);
+    parser.addOption(cyclesOption);
+    parser.addOption(timeOption);
+    parser.addOption(untilPcOption);
+    parser.addOption(untilIdleOption);
+    parser.addOption(lcdOption);
+    parser.addOption(saveOption);
+    parser.addOption(dumpOption);
+    parser.addOption(dumpFilterOption);
+    parser.addOption(dumpAppsOption);
+    parser.addOption(dumpBackupOption);
+    parser.addOption(exportOption);
+
+    parser.process(app);
+
+    if ( !parser.isSet(romOption) )
+    {
+        fprintf(stderr, "No ROM given, see --help\n");
+        return 1;
+    }
+
+    Calc calc;
+
+    // before load() so that the first frame is exported too
+    if ( parser.isSet(exportOption) )
+        calc.setLcdExport(parser.value(exportOption));
+
+    QStringList states = parser.values(stateOption);
+    const bool batch = states.count() > 1;
+
+    if ( states.isEmpty() )
+        states << QString();
+
+    // one calc, and one link session, for all the states
+    foreach ( const QString& state, states )
+    {
+        calc.load(parser.value(romOption), state);
+
+        if ( !calc.isValid() )
+            return 1;
+
+        // from here on emulation is driven from this thread
+        calc.pause();
+
+        // 1) injection runs the core synchronously, whatever it cannot do is queued as link transfers
+        if ( parser.isSet(injectOption) )
+        {
+            // the loader wants the OS idle, a saved state may stop anywhere
+            for ( int i = 0; i < 100 && !calc.isIdle(); ++i )
+                calc.run_us(1000);
+        }
+
+        foreach ( const QString& file, parser.values(injectOption) )
+        {
+            if ( !calc.link()->isSupportedFile(file) )
+                fprintf(stderr, "Skipping unsupported file \"%s\"\n", qPrintable(file));
+            else if ( !calc.link()->inject(file) )
+                fprintf(stderr, "Sending \"%s\" through the link port instead\n", qPrintable(file));
+        }
+
+        // 2) link transfers need the emulator thread, run it unthrottled
+        QStringList files = parser.values(sendOption);
+
+        if ( files.count() || calc.link()->isSending() )
+        {
+            calc.setTurbo(true);
+            calc.resume();
+
+            QEventLoop loop;
+            QObject::connect(calc.link(), SIGNAL( transfersDone() ), &loop, SLOT( quit() ));
+
+            foreach ( const QString& file, files )
+            {
+                if ( !calc.link()->isSupportedFile(file) )
+                    fprintf(stderr, "Skipping unsupported file \"%s\"\n", qPrintable(file));
+                else
+                    calc.link()->send(file);
+            }
+
+            // a stale transfersDone() may come from an earlier row of transfers
+            while ( calc.link()->isSending() )
+                loop.exec();
+
+            calc.pause();
+            calc.setTurbo(false);
+        }
+
+        // 3) keys
+        const int keyDelay = qMax(1, parser.value(keyDelayOption).toInt()) * 1000;
+
+        foreach ( const QString& key, parser.values(keyOption) )
+        {
+            int code = key_code(key);
+
+            if ( code < 0 )
+            {
+                fprintf(stderr, "Unknown key \"%s\"\n", qPrintable(key));
+                return 1;
+            }
+
+            calc.pressKey(code);
+            calc.run_us(keyDelay);
+            calc.releaseKey(code);
+            calc.run_us(keyDelay);
+        }
+
+        // 4) run
+        bool untilIdle = parser.isSet(untilIdleOption);
+        bool untilPc = parser.isSet(untilPcOption);
+
+        qint64 limit = 0;
+
+        if ( parser.isSet(cyclesOption) )
+            limit = parser.value(cyclesOption).toLongLong();
+        else if ( parser.isSet(timeOption) )
+            limit = parser.value(timeOption).toLongLong() * calc.clockSpeed();
+        else if ( untilIdle || untilPc )
+            limit = -1;
+
+        if ( untilPc )
+        {
+            bool ok;
+            dword pc = parser.value(untilPcOption).toUInt(&ok, 0);
+
+            if ( !ok )
+            {
+                fprintf(stderr, "Invalid address \"%s\"\n", qPrintable(parser.value(untilPcOption)));
+                return 1;
+            }
+
+            calc.addBreakpoint(0);
+            calc.setBreakpointStartAddress(0, pc);
+            calc.setBreakpointEndAddress(0, pc);
+        }
+
+        const char *reason = "limit";
+        const int chunk = 10000;
+        const quint64 start = calc.cycles();
+        qint64 total = 0;
+
+        while ( limit < 0 || total < limit )
+        {
+            int amount = limit < 0 ? chunk : int(qMin(qint64(chunk), limit - total));
+            dword res = calc.run_cc(amount);
+
+            // a breakpoint stops short of amount
+            total = qint64(calc.cycles() - start);
+
+            if ( res & TILEM_STOP_BREAKPOINT )
+            {
+                reason = "pc";
+                break;
+            }
+
+            if ( untilIdle && calc.isHalted() )
+            {
+                reason = "idle";
+                break;
+            }
+        }
+
+        if ( batch )
+            printf("state=%s ", qPrintable(state));
+
+        printf("cycles=%lld stop=%s\n", (long long) total, reason);
+
+        // 5) receive, through the link session kept from one state to the next
+        if ( parser.isSet(dumpOption) )
+        {
+            int contents = LinkTransfer::Variables;
+
+            if ( parser.isSet(dumpAppsOption) )
+                contents |= LinkTransfer::Apps;
+
+            if ( parser.isSet(dumpBackupOption) )
+                contents |= LinkTransfer::Backup;
+
+            QString dir = parser.value(dumpOption);
+
+            if ( batch )
+                dir = QDir(dir).filePath(QFileInfo(state).completeBaseName());
+
+            calc.setTurbo(true);
+            calc.resume();
+
+            LinkTransfer *t = TransferManager::instance()->receive(&calc, dir, contents, parser.value(dumpFilterOption));
+
+            if ( !t )
+            {
+                fprintf(stderr, "No link to receive through\n");
+                return 1;
+            }
+
+            QEventLoop loop;
+            QObject::connect(t, SIGNAL( finished() ), &loop, SLOT( quit() ));
+            loop.exec();
+
+            calc.pause();
+            calc.setTurbo(false);
+
+            if ( t->state() != LinkTransfer::Done )
+            {
+                fprintf(stderr, "%s\n", qPrintable(t->error()));
+                return 1;
+            }
+
+            printf("dumped=%d\n", t->files().count());
+
+            TransferManager::instance()->clearFinished();
+            app.sendPostedEvents(0, QEvent::DeferredDelete);
+        }
+
+        // 6) LCD and state
+        if ( parser.isSet(lcdOption) && !dump_lcd(calc, state_file(parser.value(lcdOption), state, batch)) )
+            return 1;
+
+        if ( parser.isSet(saveOption) )
+            calc.save(state_file(parser.value(saveOption), state, batch));
+    }
+
+    return 0;
+}
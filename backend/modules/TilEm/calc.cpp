@@ -15,6 +15,9 @@
 #include "calc.h"
 #include "calclink.h"
 #include "calcthread.h"
+#include "emulatorpool.h"
+#include "slicetuner.h"
+#include "lcdgray.h"
 
 /*!
     \file calc.cp
@@ -24,13 +27,121 @@
 #include <scancodes.h>
 
 #include <QDir>
-#include <QColor>
+#include <QFile>
 #include <QFileInfo>
 #include <QMimeData>
 #include <QUrl>
 #include <QDebug>
 
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+/*
+    Dirty rectangles of the composite LCD : runs of changed pixels on one
+    row, merged into bands when they line up with the run of the row above.
+*/
+static void add_dirty_run(QVector<QRect>& rects, int x, int y, int w)
+{
+    if ( !rects.isEmpty() )
+    {
+        QRect& r = rects.last();
+
+        if ( r.top() == y && r.left() + r.width() == x )
+        {
+            r.setWidth(r.width() + w);
+            return;
+        }
+    }
+
+    rects << QRect(x, y, w, 1);
+}
+
+static void merge_dirty_rows(QVector<QRect>& rects)
+{
+    QVector<QRect> bands;
+
+    foreach ( const QRect& r, rects )
+    {
+        bool merged = false;
+
+        for ( int i = bands.count() - 1; !merged && i >= 0; --i )
+        {
+            QRect& b = bands[i];
+
+            if ( b.bottom() + 1 == r.top() && b.left() == r.left() && b.width() == r.width() )
+            {
+                b.setBottom(r.bottom());
+                merged = true;
+            }
+        }
+
+        if ( !merged )
+            bands << r;
+    }
+
+    // past a point one repaint beats many small ones
+    if ( bands.count() > 16 )
+    {
+        QRect all;
+
+        foreach ( const QRect& b, bands )
+            all |= b;
+
+        bands.clear();
+        bands << all;
+    }
+
+    rects = bands;
+}
+
+/*
+    64 bit FNV-1a of an LCD frame, a word at a time : a few hundred bytes
+    to tell whether the picture changed at all.
+*/
+static quint64 lcd_hash(const QByteArray& lcd)
+{
+    const quint64 prime = Q_UINT64_C(0x100000001b3);
+    quint64 h = Q_UINT64_C(0xcbf29ce484222325);
+
+    const char *p = lcd.constData();
+    int n = lcd.size();
+
+    for ( ; n >= 8; p += 8, n -= 8 )
+    {
+        quint64 w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * prime;
+    }
+
+    for ( ; n > 0; ++p, --n )
+        h = (h ^ (unsigned char) *p) * prime;
+
+    return h;
+}
+
+/*
+    Doubles shared between threads, see Calc::speed() and Calc::emulatedMHz()
+*/
+static quint64 real_bits(double v)
+{
+    quint64 b;
+    memcpy(&b, &v, sizeof(b));
+    return b;
+}
+
+static double bits_real(quint64 b)
+{
+    double v;
+    memcpy(&v, &b, sizeof(v));
+    return v;
+}
+
+/*
+    Slices an injection waits for the OS to go idle before it is refused,
+    see Calc::injectVar()
+*/
+static const int InjectTries = 100;
 
 class RegisterDword
 {
@@ -44,6 +155,7 @@ class RegisterDword
 static RegisterDword rdw;
 
 QHash<TilemCalc*, Calc*> Calc::m_table;
+QReadWriteLock Calc::m_tableLock;
 
 /*!
     \class Calc
@@ -53,24 +165,39 @@ QHash<TilemCalc*, Calc*> Calc::m_table;
 */
 
 Calc::Calc(QObject *p)
- : QObject(p), m_calc(0), m_lcd(0), m_lcd_comp(0), m_link(NULL), m_thread(NULL)
+ : QObject(p), m_calc(0), m_lcd_level(0), m_lcdSequence(0), m_lcdHash(0), m_frameSequence(0), m_sampleIn(0), m_deferred(0), m_speed(real_bits(1.0)), m_catchUpLimit(100),
+   m_turbo(0), m_turboFrameInterval(100), m_mhz(real_bits(0)),
+   m_sliceLength(10000), m_autoSlice(true), m_currentSlice(0), m_sliceOverhead(real_bits(0)),
+   m_runs(0), m_overheadNs(0), m_lastInput(-1000),
+   m_frameDriven(false), m_frameRunning(false),
+   m_deterministic(false), m_recording(false), m_replaying(false),
+   m_cycles(0), m_sliceCycles(0), m_replayIndex(0), m_woken(false),
+   m_link(NULL), m_thread(NULL), m_pool(NULL)
 {
+    m_inputClock.start();
+
 
 }
 
 Calc::~Calc()
 {
-    delete m_lcd_comp;
-    delete m_lcd;
-    if(m_thread)
-        m_thread->stop();
+    stopEmulation();
+
+    delete[] m_lcd_level;
 
     delete m_link;
 
     QMutexLocker lock(&m_run);
 
+    while ( m_deferred )
+    {
+        CalcCommand *next = m_deferred->next;
+        delete m_deferred;
+        m_deferred = next;
+    }
+
     if(m_calc) {
-        m_table.remove(m_calc);
+        unregisterCalc();
 
         // release memory
         tilem_calc_free(m_calc);
@@ -116,11 +243,141 @@ bool Calc::isPaused() const
 bool Calc::isRunning() const
 {
     qDebug() << "Calc: isRunning";
+    if(m_frameDriven)
+        return m_frameRunning;
+    if(m_pool)
+        return m_pool->contains(this);
     if(m_thread)
         return m_thread->isRunning();
     return false;
 }
 
+/**
+ * @brief Pool running this calc, if any
+ *
+ * @return 0 when the calc has its own emulator thread
+ */
+EmulatorPool* Calc::pool() const
+{
+    return m_pool;
+}
+
+/**
+ * @brief Run this calc on a pool of worker threads instead of its own thread
+ *
+ * @param pool The pool, 0 to go back to a dedicated thread
+ */
+void Calc::setPool(EmulatorPool *pool)
+{
+    qDebug() << "Calc: setPool";
+    if ( pool == m_pool )
+        return;
+
+    bool running = isRunning();
+
+    if ( running )
+        stopEmulation();
+
+    m_pool = pool;
+
+    if ( running )
+        startEmulation();
+
+    emit pooledChanged(m_pool != 0);
+}
+
+/**
+ * @brief Whether this calc runs on the shared EmulatorPool
+ *
+ * @return
+ */
+bool Calc::isPooled() const
+{
+    return m_pool;
+}
+
+void Calc::setPooled(bool y)
+{
+    setPool(y ? EmulatorPool::instance() : 0);
+}
+
+/**
+ * @brief Whether the emulated CPU is halted, waiting for an interrupt
+ *
+ * @return
+ */
+bool Calc::isHalted() const
+{
+    return m_calc && m_calc->z80.halted;
+}
+
+/**
+ * @brief Whether the calc is idle : halted with no interrupt pending and no link data to process
+ *
+ * Only a timer interrupt, a key or the link can get it going again. Keys
+ * and resets still queued for the next slice count as activity already :
+ * slice lengths are picked before beginSlice() applies them.
+ *
+ * @return
+ */
+bool Calc::isIdle() const
+{
+    return m_calc && m_calc->z80.halted && !m_calc->z80.interrupts
+        && !m_input.count() && !m_lockstepInput.count() && !m_link_lock
+        && m_commands.isEmpty() && !m_deferred;
+}
+
+/**
+ * @brief Whether the calc is turned off
+ *
+ * The CPU is halted and, unlike a regular halt, only the ON key (or the
+ * link) wakes it up : there is nothing to emulate until then.
+ *
+ * @return
+ */
+bool Calc::isPoweredOff() const
+{
+    return isIdle() && !m_calc->poweronhalt;
+}
+
+/**
+ * @brief Wake the emulator up if it is sleeping between two slices
+ *
+ * Called whenever input (key, link byte, reset) is pending or emulation
+ * should stop, so that it is handled right away rather than after the
+ * rest of the sleep.
+ */
+void Calc::wakeUp()
+{
+    m_wakeLock.lock();
+    m_woken = true;
+    m_wake.wakeAll();
+    m_wakeLock.unlock();
+
+    if ( m_pool )
+        m_pool->wake(this);
+}
+
+/**
+ * @brief Sleep until wakeUp() is called or the timeout expires
+ *
+ * @param usec Timeout in microseconds
+ *
+ * @return whether the wait was cut short
+ */
+bool Calc::waitForWakeUp(qint64 usec)
+{
+    QMutexLocker l(&m_wakeLock);
+
+    if ( !m_woken && usec > 0 )
+        m_wake.wait(&m_wakeLock, (usec + 999) / 1000);
+
+    bool woken = m_woken;
+    m_woken = false;
+
+    return woken;
+}
+
 /**
  * @brief Name of the current calculator
  *
@@ -177,231 +434,460 @@ QString Calc::romFile() const
 }
 
 /**
- * @brief Set name of the calculator
+ * @brief Emulation speed relative to real hardware
  *
- * @param n
+ * @return 1.0 when running at the speed of a real calculator
  */
-void Calc::setName(const QString& n)
+qreal Calc::speed() const
 {
-    qDebug() << "Calc: setName";
-    if ( n == m_name )
-        return;
-
-    m_name = n;
-
-    emit nameChanged(n);
+    return bits_real(m_speed.load());
 }
 
 /**
- * @brief Reset the link
+ * @brief Set the emulation speed relative to real hardware
+ *
+ * @param speed 1.0 for real hardware speed, 2.0 for twice as fast, ...
  */
-void Calc::resetLink()
+void Calc::setSpeed(qreal speed)
 {
-    qDebug() << "Calc: resetLink";
-    tilem_linkport_graylink_reset(m_calc);
-}
+    qDebug() << "Calc: setSpeed" << speed;
+    speed = qMax(qreal(0.01), speed);
 
-bool Calc::isBroadcasting() const
-{
-    qDebug() << "Calc: isBroadcasting";
-    return m_broadcast;
+    if ( qFuzzyCompare(speed, Calc::speed()) )
+        return;
+
+    m_speed.store(real_bits(speed));
+
+    emit speedChanged(speed);
 }
 
-void Calc::setBroadcasting(bool y)
+/**
+ * @brief How far (in ms) emulation may catch up after the host stalled
+ *
+ * @return
+ */
+int Calc::catchUpLimit() const
 {
-    qDebug() << "Calc: setBroadcasting";
-    m_broadcast = y;
+    return m_catchUpLimit.load();
 }
 
 /**
- * @brief Whether the *calc* is writing data through the linkport
+ * @brief Set how far (in ms) emulation may catch up after the host stalled
  *
- * @return 
+ * Backlog beyond this limit is dropped instead of being run back-to-back.
+ *
+ * @param msec
  */
-bool Calc::isSending() const
+void Calc::setCatchUpLimit(int msec)
 {
-    qDebug() << "Calc: isSending";
-    return m_output.count();
+    qDebug() << "Calc: setCatchUpLimit" << msec;
+    msec = qMax(0, msec);
+
+    if ( msec == m_catchUpLimit.load() )
+        return;
+
+    m_catchUpLimit.store(msec);
+
+    emit catchUpLimitChanged(msec);
 }
 
 /**
- * @brief Whether the *calc* has data to read from the linkport
+ * @brief Whether emulation runs unthrottled
  *
- * @return 
+ * @return
  */
-bool Calc::isReceiving() const
+bool Calc::isTurbo() const
 {
-    qDebug() << "Calc: isReceiving";
-    return m_input.count();
+    return m_turbo.load();
 }
 
 /**
- * @brief Whether the file is supported to be send 
+ * @brief Run emulation as fast as the host allows
  *
- * @param md
+ * In turbo mode the emulator thread runs large slices back-to-back without
+ * sleeping and the LCD is only composited every turboFrameInterval() ms.
  *
- * @return 
+ * @param y
  */
-bool Calc::isSupported(const QMimeData *md)
+void Calc::setTurbo(bool y)
 {
-    qDebug() << "Calc: isSupported";
-    if ( md->hasUrls() )
-    {
-        QList<QUrl> l = md->urls();
+    qDebug() << "Calc: setTurbo" << y;
+    if ( y == isTurbo() )
+        return;
 
-        foreach ( QUrl url, l )
-            if ( m_link->isSupportedFile(url.toLocalFile()) )
-                return true;
-    }
+    m_turbo.store(y);
+    m_frameClock.invalidate();
 
-    return false;
+    emit turboChanged(y);
 }
 
 /**
- * @brief Simulate keypress on the calc
+ * @brief Minimum delay (in ms) between two LCD composites in turbo mode
  *
- * @param keycode Key to be pressed
+ * @return
  */
-void Calc::pressKey(int keycode)
+int Calc::turboFrameInterval() const
 {
-    qDebug() << "Calc: press " << keycode;
-    if(isValid())
-        tilem_keypad_press_key(m_calc, keycode);
+    return m_turboFrameInterval.load();
+}
+
+void Calc::setTurboFrameInterval(int msec)
+{
+    qDebug() << "Calc: setTurboFrameInterval" << msec;
+    msec = qMax(0, msec);
+
+    if ( msec == m_turboFrameInterval.load() )
+        return;
+
+    m_turboFrameInterval.store(msec);
+
+    emit turboFrameIntervalChanged(msec);
 }
 
 /**
- * @brief Simulate keyresease on the calc
+ * @brief Whether emulation is driven by the display, see runFrame()
  *
- * @param keycode Key to be released
+ * @return
  */
-void Calc::releaseKey(int keycode)
+bool Calc::isFrameDriven() const
 {
-    qDebug() << "Calc: release " << keycode;
-    if(isValid())
-        tilem_keypad_release_key(m_calc, keycode);
+    return m_frameDriven;
 }
 
-QStringList Calc::guessRomType(QString url)
+/**
+ * @brief Let the display drive emulation instead of the emulator thread (or pool)
+ *
+ * Pausing and resuming work as usual, but while "running" nothing is
+ * emulated until runFrame() is called.
+ *
+ * @param y
+ */
+void Calc::setFrameDriven(bool y)
 {
-    FILE *romfile = fopen(qPrintable(url), "rb");
-
-    if ( !romfile )
-    {
-        qWarning(qPrintable(tr("Unable to load ROM file \"%s\": %s")),
-             qPrintable(url), strerror(errno));
-        return QStringList();
-    }
-    char rom_type = tilem_guess_rom_type(romfile);
+    qDebug() << "Calc: setFrameDriven" << y;
+    if ( y == m_frameDriven )
+        return;
 
-    QStringList options;
-    int nmodels, selected;
-    const TilemHardware** models;
+    const bool running = isRunning();
 
-    tilem_get_supported_hardware(&models, &nmodels);
+    stopEmulation();
 
-    for ( int i = 0; i < nmodels; ++i )
-    {
-        options << QString::fromLatin1(models[i]->desc);
+    m_frameDriven = y;
 
-        if ( models[i]->model_id == rom_type )
-            selected = i;
-    }
+    if ( running )
+        startEmulation();
 
-    return options;
+    emit frameDrivenChanged(y);
 }
 
 /**
- * @brief step the calc
+ * @brief Run the emulated time matching one display frame, in frame driven mode
+ *
+ * This runs on the GUI thread : emulation is cut into slices and stops
+ * once budget is spent, whatever the speed, so that the display keeps
+ * its rate. In turbo mode as many slices as fit in the budget are run.
+ *
+ * @param usec Host time elapsed since the previous frame
+ * @param budget Host time emulation may take, in microseconds
+ *
+ * @return the stop reason, emulation is paused when it is not 0
  */
-void Calc::step()
+dword Calc::runFrame(int usec, int budget)
 {
-    qDebug() << "Calc: step";
-    if(m_thread)
-        m_thread->step();
+    if ( !m_frameDriven || !m_frameRunning )
+        return 0;
+
+    const bool turbo = isTurbo();
+    const qint64 target = qMax(1, int(usec * speed()));
+
+    QElapsedTimer timer;
+    timer.start();
+
+    qint64 done = 0;
+    dword res;
+
+    do
+    {
+        int amount = sliceLength();
+
+        if ( !turbo )
+            amount = int(qMin(qint64(amount), target - done));
+
+        int emulated;
+        res = runSlice(amount, &emulated);
+
+        done += emulated;
+    } while ( !res && (turbo || done < target) && timer.nsecsElapsed() < qint64(budget) * 1000 );
+
+    setEmulatedMHz(usec > 0 ? qreal(done) * clockSpeed() / 1000 / usec : 0);
+
+    // breakpoint or link error : stop, as CalcThread does
+    if ( res )
+        stopEmulation();
+
+    return res;
 }
 
 /**
- * @brief Pause the calc
+ * @brief Emulated clock speed actually achieved, in MHz
+ *
+ * Measured by the emulator thread, 0 while it is not running.
+ *
+ * @return
  */
-void Calc::pause()
+qreal Calc::emulatedMHz() const
 {
-    qDebug() << "Calc: pauze";
-    if ( m_thread && isRunning() )
-        m_thread->stop();
+    return bits_real(m_mhz.load());
+}
+
+/*
+    Called from the emulator thread, pool workers or the GUI thread : the
+    notification always reaches QML on the thread of the Calc.
+*/
+void Calc::setEmulatedMHz(qreal mhz)
+{
+    const qreal old = bits_real(m_mhz.fetchAndStoreOrdered(real_bits(mhz)));
+
+    if ( qFuzzyCompare(mhz + 1, old + 1) )
+        return;
+
+    QMetaObject::invokeMethod(this, "emulatedMHzChanged", Qt::QueuedConnection, Q_ARG(qreal, mhz));
 }
 
 /**
- * @brief Resume the calc
+ * @brief Length of the slices of emulated time run between two host sleeps, in microseconds
+ *
+ * With autoSlice() this is an upper bound for regular (not idle, not
+ * turbo) emulation, otherwise it is used as is.
+ *
+ * @return
  */
-void Calc::resume()
+int Calc::sliceLength() const
 {
-    qDebug() << "Calc: resume";
-    if ( m_thread && !isRunning() )
-        m_thread->start();
+    return m_sliceLength;
+}
+
+void Calc::setSliceLength(int usec)
+{
+    qDebug() << "Calc: setSliceLength" << usec;
+    usec = qBound(int(SliceTuner::MinSlice), usec, int(SliceTuner::TurboSlice));
+
+    if ( usec == m_sliceLength )
+        return;
+
+    m_sliceLength = usec;
+
+    emit sliceLengthChanged(usec);
 }
 
 /**
- * @brief Save the calc
+ * @brief Whether slice lengths adapt to link and keypad activity, see SliceTuner
+ *
+ * @return
  */
-void Calc::save()
+bool Calc::isAutoSlice() const
 {
-    qDebug() << "Calc: save";
+    return m_autoSlice;
+}
+
+void Calc::setAutoSlice(bool y)
+{
+    qDebug() << "Calc: setAutoSlice" << y;
+    if ( y == m_autoSlice )
+        return;
+
+    m_autoSlice = y;
+
+    emit autoSliceChanged(y);
 }
 
 /**
- * @brief Load a rom file on the calc
+ * @brief Length of the slices currently run, in microseconds
  *
- * @param file The rom file to be loaded
+ * @return
  */
-void Calc::load(const QString &file)
+int Calc::currentSlice() const
 {
-    qDebug() << "Calc: load a file" << file;
-    /// 1) stop/cleanup phase
-    emit beginLoad();
+    return m_currentSlice.load();
+}
 
-    if ( m_thread )
-        m_thread->stop();
+/**
+ * @brief Measured host time spent per slice outside of the emulator core, in microseconds
+ *
+ * @return
+ */
+qreal Calc::sliceOverhead() const
+{
+    return bits_real(m_sliceOverhead.load());
+}
+
+/**
+ * @brief Whether the link or the keypad is in use, which calls for short slices
+ *
+ * @return
+ */
+bool Calc::isBusy() const
+{
+    return m_input.count() || m_output.count() || m_link_lock
+        || quint32(int(m_inputClock.elapsed()) - m_lastInput.load()) < 250;
+}
+
+/**
+ * @brief Report the slice length in use and turn accumulated run timings into sliceOverhead()
+ *
+ * Called from the emulation thread (or pool worker), notifications are queued.
+ *
+ * @param current
+ */
+void Calc::updateSliceStats(int current)
+{
+    if ( m_currentSlice.fetchAndStoreOrdered(current) != current )
+        QMetaObject::invokeMethod(this, "currentSliceChanged", Qt::QueuedConnection, Q_ARG(int, current));
 
-    // 2) load phase
     QMutexLocker lock(&m_run);
 
-    QFileInfo info(file);
+    const int runs = m_runs;
+    const qint64 overheadNs = m_overheadNs;
 
-    FILE *romfile, *savefile = 0;
+    m_runs = 0;
+    m_overheadNs = 0;
 
-//    QString savefilename = QDir(info.path()).filePath(info.completeBaseName() + ".sav");
+    lock.unlock();
 
-    romfile = fopen(qPrintable(file), "rb");
+    if ( !runs )
+        return;
 
-    if ( !romfile )
-    {
-        qWarning(qPrintable(tr("Unable to load ROM file \"%s\": %s")),
-             qPrintable(file), strerror(errno));
+    qreal overhead = qreal(overheadNs) / 1000 / runs;
+
+    const qreal old = bits_real(m_sliceOverhead.fetchAndStoreOrdered(real_bits(overhead)));
+
+    if ( qFuzzyCompare(overhead + 1, old + 1) )
         return;
-    } else {
-        m_load_lock = true;
-        //qDebug("successfully opened %s", qPrintable(file));
-    }
 
-//    savefile = fopen(qPrintable(savefilename), "rt");
+    QMetaObject::invokeMethod(this, "sliceOverheadChanged", Qt::QueuedConnection, Q_ARG(qreal, overhead));
+}
 
-    if ( m_calc )
-    {
-        //qDebug("cleanin up previous state.");
-        m_table.remove(m_calc);
+/**
+ * @brief Nominal clock speed of the emulated CPU
+ *
+ * @return speed in kHz
+ */
+int Calc::clockSpeed() const
+{
+    return m_calc ? m_calc->z80.clockspeed : 0;
+}
 
-        tilem_calc_free(m_calc);
-        m_calc = 0;
+/**
+ * @brief Set name of the calculator
+ *
+ * @param n
+ */
+void Calc::setName(const QString& n)
+{
+    qDebug() << "Calc: setName";
+    if ( n == m_name )
+        return;
+
+    m_name = n;
+
+    emit nameChanged(n);
+}
+
+/**
+ * @brief Reset the link
+ */
+void Calc::resetLink()
+{
+    qDebug() << "Calc: resetLink";
+    tilem_linkport_graylink_reset(m_calc);
+}
+
+bool Calc::isBroadcasting() const
+{
+    qDebug() << "Calc: isBroadcasting";
+    return m_broadcast;
+}
+
+void Calc::setBroadcasting(bool y)
+{
+    qDebug() << "Calc: setBroadcasting";
+    m_broadcast = y;
+}
+
+/**
+ * @brief Whether the *calc* is writing data through the linkport
+ *
+ * @return 
+ */
+bool Calc::isSending() const
+{
+    return m_output.count();
+}
+
+/**
+ * @brief Whether the *calc* has data to read from the linkport
+ *
+ * @return 
+ */
+bool Calc::isReceiving() const
+{
+    return m_input.count() || m_lockstepInput.count();
+}
 
-        delete m_lcd_comp;
-        m_lcd_comp = 0;
+/**
+ * @brief Whether the file is supported to be send 
+ *
+ * @param md
+ *
+ * @return 
+ */
+bool Calc::isSupported(const QMimeData *md)
+{
+    qDebug() << "Calc: isSupported";
+    if ( md->hasUrls() )
+    {
+        QList<QUrl> l = md->urls();
 
-        delete m_lcd;
-        m_lcd = 0;
+        foreach ( QUrl url, l )
+            if ( m_link->isSupportedFile(url.toLocalFile()) )
+                return true;
     }
 
-    m_romFile = file;
+    return false;
+}
+
+/**
+ * @brief Simulate keypress on the calc
+ *
+ * @param keycode Key to be pressed
+ */
+void Calc::pressKey(int keycode)
+{
+    qDebug() << "Calc: press " << keycode;
+    post(new CalcCommand(CalcCommand::KeyPress, keycode));
+}
+
+/**
+ * @brief Simulate keyresease on the calc
+ *
+ * @param keycode Key to be released
+ */
+void Calc::releaseKey(int keycode)
+{
+    qDebug() << "Calc: release " << keycode;
+    post(new CalcCommand(CalcCommand::KeyRelease, keycode));
+}
+
+QStringList Calc::guessRomType(QString url)
+{
+    FILE *romfile = fopen(qPrintable(url), "rb");
 
+    if ( !romfile )
+    {
+        qWarning(qPrintable(tr("Unable to load ROM file \"%s\": %s")),
+             qPrintable(url), strerror(errno));
+        return QStringList();
+    }
     char rom_type = tilem_guess_rom_type(romfile);
 
     QStringList options;
@@ -418,452 +904,1365 @@ void Calc::load(const QString &file)
             selected = i;
     }
 
-//    QString t =
-//    QInputDialog::getItem(
-//                        0,
-//                        tr("Select ROM type"),
-//                        tr("Select ROM type (keep default if unsure)"),
-//                        options,
-//                        selected,
-//                        false
-//                    );
+    return options;
+}
+
+/**
+ * @brief step the calc
+ */
+void Calc::step()
+{
+    qDebug() << "Calc: step";
+    if(m_thread)
+        m_thread->step();
+}
+
+/**
+ * @brief Pause the calc
+ */
+void Calc::pause()
+{
+    qDebug() << "Calc: pauze";
+    if ( m_thread && isRunning() )
+        stopEmulation();
+}
+
+/**
+ * @brief Resume the calc
+ */
+void Calc::resume()
+{
+    qDebug() << "Calc: resume";
+    if ( m_thread && !isRunning() )
+        startEmulation();
+}
+
+/**
+ * @brief Stop whichever of the thread or the pool is driving emulation
+ */
+void Calc::stopEmulation()
+{
+    if ( m_frameDriven )
+    {
+        if ( m_frameRunning )
+        {
+            m_frameRunning = false;
+
+            setEmulatedMHz(0);
+
+            emit paused();
+            emit paused(false);
+        }
+    } else if ( m_pool )
+        m_pool->remove(this);
+    else if ( m_thread )
+        m_thread->stop();
+}
+
+/**
+ * @brief Hand emulation to the pool or the emulator thread
+ */
+void Calc::startEmulation()
+{
+    if ( m_frameDriven )
+    {
+        if ( !m_frameRunning && m_calc )
+        {
+            m_frameRunning = true;
+
+            emit resumed();
+            emit paused(true);
+        }
+    } else if ( m_pool )
+        m_pool->add(this);
+    else if ( m_thread )
+        m_thread->start();
+}
+
+/**
+ * @brief Save the calc
+ */
+void Calc::save()
+{
+    qDebug() << "Calc: save";
+}
+
+/**
+ * @brief Load a rom file on the calc
+ *
+ * @param file The rom file to be loaded
+ */
+void Calc::load(const QString &file)
+{
+    load(file, QString());
+}
+
+/**
+ * @brief Load a rom file and a saved state on the calc
+ *
+ * @param file The rom file to be loaded
+ * @param state The state file to restore, none if empty
+ */
+void Calc::load(const QString &file, const QString &state)
+{
+    doLoad(file, state, true);
+}
+
+/**
+ * @brief Load a rom file and a saved state, restarting emulation or not
+ *
+ * @param file The rom file to be loaded
+ * @param state The state file to restore, none if empty
+ * @param start Whether to hand the calc back to the emulator thread (or pool)
+ */
+void Calc::doLoad(const QString &file, const QString &state, bool start)
+{
+    qDebug() << "Calc: load a file" << file << state;
+    /// 1) stop/cleanup phase
+    emit beginLoad();
+
+    stopEmulation();
+
+    // 2) load phase
+    QMutexLocker lock(&m_run);
+
+    QFileInfo info(file);
+
+    FILE *romfile, *savefile = 0;
+
+//    QString savefilename = QDir(info.path()).filePath(info.completeBaseName() + ".sav");
+
+    romfile = fopen(qPrintable(file), "rb");
+
+    if ( !romfile )
+    {
+        qWarning(qPrintable(tr("Unable to load ROM file \"%s\": %s")),
+             qPrintable(file), strerror(errno));
+        return;
+    } else {
+        m_load_lock = true;
+        //qDebug("successfully opened %s", qPrintable(file));
+    }
+
+    if ( !state.isEmpty() && !(savefile = fopen(qPrintable(state), "rt")) )
+    {
+        qWarning(qPrintable(tr("Unable to load state file \"%s\": %s")),
+             qPrintable(state), strerror(errno));
+    }
+
+    if ( m_calc )
+    {
+        //qDebug("cleanin up previous state.");
+        unregisterCalc();
+
+        tilem_calc_free(m_calc);
+        m_calc = 0;
+
+        delete[] m_lcd_level;
+        m_lcd_level = 0;
+
+        m_snapshotLock.lock();
+        m_snapshot.clear();
+        m_snapshotLock.unlock();
+    }
+
+    m_romFile = file;
+
+    char rom_type = tilem_guess_rom_type(romfile);
+
+    QStringList options;
+    int nmodels, selected;
+    const TilemHardware** models;
+
+    tilem_get_supported_hardware(&models, &nmodels);
+
+    for ( int i = 0; i < nmodels; ++i )
+    {
+        options << QString::fromLatin1(models[i]->desc);
+
+        if ( models[i]->model_id == rom_type )
+            selected = i;
+    }
+
+//    QString t =
+//    QInputDialog::getItem(
+//                        0,
+//                        tr("Select ROM type"),
+//                        tr("Select ROM type (keep default if unsure)"),
+//                        options,
+//                        selected,
+//                        false
+//                    );
+
+//    selected = options.indexOf(t);
+
+    if ( selected != -1 )
+        rom_type = models[selected]->model_id;
+
+    //qDebug("%c", rom_type);
+
+    m_calc = tilem_calc_new(rom_type);
+
+    // breakpoints went away with the previous core
+    m_breakIds.clear();
+
+    m_tableLock.lockForWrite();
+    m_table[m_calc] = this;
+    m_tableLock.unlock();
+
+    tilem_calc_load_state(m_calc, romfile, savefile);
+
+    // some link emulation magic...
+    m_calc->linkport.linkemu = TILEM_LINK_EMULATOR_GRAY;
+    m_calc->z80.stop_mask &= ~(TILEM_STOP_LINK_READ_BYTE | TILEM_STOP_LINK_WRITE_BYTE | TILEM_STOP_LINK_ERROR);
+
+    m_broadcast = true;
+    m_link_lock = false;
+
+    m_cycles = 0;
+    m_pressCycles.clear();
+    m_lockstepInput.remove(m_lockstepInput.count());
+
+    // "composite" LCD state (grayscale is a bitch...), the instant one comes with snapshots
+    const int pixels = m_calc->hw.lcdwidth * m_calc->hw.lcdheight;
+
+    m_lcd_level = new unsigned char[pixels];
+
+    memset(m_lcd_level, 0xff, pixels);
+
+    m_lcdSequence = 0;
+    m_lcdHash = 0;
+
+    // a full window of the restored LCD, so that a paused calc shows it
+    m_gray.reset(pixels);
+    m_frames.reset(m_calc->hw.lcdwidth, m_calc->hw.lcdheight);
+    m_frameSequence = 0;
+
+    if ( !m_lcdExportName.isEmpty() )
+        m_lcdExport.create(m_lcdExportName, m_calc->hw.lcdwidth, m_calc->hw.lcdheight);
+    m_sample = QByteArray(pixels / 8, 0);
+
+    for ( int i = 0; i < LcdGray::Samples; ++i )
+        sampleLcd();
+
+    m_sampleIn = qint64(m_calc->z80.clockspeed) * LcdGray::SampleUsec / 1000;
+
+    m_calc->lcd.emuflags = TILEM_LCD_REQUIRE_DELAY;
+    m_calc->flash.emuflags = TILEM_FLASH_REQUIRE_DELAY;
+
+    publishSnapshot();
+
+    fclose(romfile);
+
+    if ( savefile )
+        fclose(savefile);
+
+    m_load_lock = false;
+
+    emit fileChanged(romFile());
+
+    if ( !m_link )
+    {
+        m_link = new CalcLink(this, this);
+
+//        connect(m_link, SIGNAL( externalLinkGrabbed(bool) ), this, SIGNAL( externalLinkGrabbed(bool) ));
+    } else
+        m_link->setCalc(this);
+
+    if ( !m_thread )
+    {
+        m_thread = new CalcThread(this, this);
+        connect(m_thread, SIGNAL( started() ), this, SIGNAL( resumed() ) );
+        connect(m_thread, SIGNAL( finished() ), this, SIGNAL( paused() ) );
+        connect(m_thread, SIGNAL( runningChanged(bool) ), this, SIGNAL( paused(bool) ) );
+    }
+
+    /// 3) restart phase
+
+    // launch emulator thread (or hand over to the pool)
+    if ( start )
+        startEmulation();
+
+    // start LCD update timer
+    emit loaded();
+
+    setModel();
+}
+
+/**
+ * @brief Save the current state
+ *
+ * @param file File to be saved to
+ */
+void Calc::save(const QString &file)
+{
+    qDebug() << "Calc: save to file";
+    if ( isRunning() )
+    {
+        // done by the emulation thread at the end of the current slice
+        post(new CalcCommand(CalcCommand::Save, 0, file));
+        return;
+    }
+
+    QMutexLocker lock(&m_run);
+
+    doSave(file);
+}
+
+void Calc::doSave(const QString &file)
+{
+    if ( !m_calc )
+        return;
+
+    QFileInfo info(file);
+
+    FILE *romfile, *savefile;
+
+    QString savefilename = QDir(info.path()).filePath(info.completeBaseName() + ".sav");
+
+    if ( !(m_calc->hw.flags & TILEM_CALC_HAS_FLASH) )
+    {
+        romfile = NULL;
+    } else if ( !(romfile = fopen(qPrintable(file), "wb")) ) {
+        qWarning(qPrintable(tr("Unable to save ROM file \"%s\": %s")),
+             qPrintable(file), strerror(errno));
+    }
+
+    if ( !(savefile = fopen(qPrintable(savefilename), "wt")) )
+    {
+        qWarning(qPrintable(tr("Unable to save state file \"%s\": %s")),
+             qPrintable(savefilename), strerror(errno));
+    }
+
+    if ( romfile || savefile )
+    {
+        // save state
+        tilem_calc_save_state(m_calc, romfile, savefile);
+    }
+
+    if ( romfile )
+        fclose(romfile);
+
+    if ( savefile )
+        fclose(savefile);
+}
+
+/*!
+    \return amount of data written to the linkport by the *calc* that can be retrieved using getByte()
+*/
+uint32_t Calc::byteCount() const
+{
+    return m_output.count();
+}
+
+/*!
+    \brief get a byte from the buffer in which calc linkport writes are stored but does not remove it from the buffer
+*/
+char Calc::topByte()
+{
+    if ( m_output.isEmpty() )
+        return 0;
+
+    char c = m_output.at(0);
+
+    return c;
+}
+
+/*!
+    \brief get a byte from the buffer in which calc linkport writes are stored
+*/
+char Calc::getByte()
+{
+    if ( m_output.isEmpty() )
+        return 0;
+
+    char c = m_output.at(0);
+
+    m_output.remove(1);
+
+    return c;
+}
+
+/*!
+    \brief send a byte to the calc
+*/
+void Calc::sendByte(char c)
+{
+    m_input += c;
+
+    wakeUp();
+}
+
+/*!
+    \brief get up to n bytes from the buffer in which calc linkport writes are stored
+*/
+QByteArray Calc::getBytes(int n)
+{
+    if ( n < 0 || m_output.isEmpty() )
+        return QByteArray();
+
+    n = qMin(n, (int)m_output.count());
+
+    return m_output.take(n);
+}
+
+/*!
+    \brief get up to n bytes from the buffer in which calc linkport writes are stored
+*/
+int Calc::getBytes(int n, char *d)
+{
+    if ( n < 0 || m_output.isEmpty() )
+        return 0;
+
+    n = qMin(n, (int)m_output.count());
+
+    m_output.take(n, d);
+
+    return n;
+}
+
+/*!
+    \brief send bytes to the calc
+*/
+void Calc::sendBytes(const QByteArray& d)
+{
+    m_input += d;
+
+    wakeUp();
+}
+
+/*!
+    \brief Block until every byte sent to the calc went through its link port
+
+    \param msec Timeout, -1 for none
+    \param abort Checked whenever the wait is woken up, see abortLinkWaits()
+
+    \return whether the input was drained
+*/
+bool Calc::waitForDrained(int msec, const QAtomicInt *abort)
+{
+    return waitForLink(0, msec, abort);
+}
+
+/*!
+    \brief Block until at least count bytes written by the calc can be retrieved
+
+    \param count
+    \param msec Timeout, -1 for none
+    \param abort Checked whenever the wait is woken up, see abortLinkWaits()
+
+    \return whether the bytes are there
+*/
+bool Calc::waitForBytes(uint32_t count, int msec, const QAtomicInt *abort)
+{
+    return waitForLink(qMax(count, uint32_t(1)), msec, abort);
+}
+
+/*!
+    \brief Wake every link wait up so that they check their abort flag
+*/
+void Calc::abortLinkWaits()
+{
+    QMutexLocker l(&m_linkWaitLock);
+    m_linkWait.wakeAll();
+}
+
+/*
+    count : bytes to wait for in the output, 0 to wait for the input to drain
+*/
+bool Calc::waitForLink(uint32_t count, int msec, const QAtomicInt *abort)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // before the first check, so that notifyLink() cannot miss us
+    m_linkWaiters.ref();
+
+    QMutexLocker l(&m_linkWaitLock);
+
+    bool done;
+
+    while ( !(done = count ? byteCount() >= count : !isReceiving()) )
+    {
+        if ( abort && abort->load() )
+            break;
+
+        const qint64 left = msec - timer.elapsed();
+
+        if ( msec >= 0 && left <= 0 )
+            break;
+
+        m_linkWait.wait(&m_linkWaitLock, msec < 0 ? ULONG_MAX : (unsigned long) left);
+    }
+
+    l.unlock();
+
+    m_linkWaiters.deref();
+
+    return done;
+}
+
+/*
+    Called by the emulation thread when it took input or produced output,
+    cheap when nobody waits.
+*/
+void Calc::notifyLink()
+{
+    if ( !m_linkWaiters.fetchAndAddOrdered(0) )
+        return;
+
+    QMutexLocker l(&m_linkWaitLock);
+    m_linkWait.wakeAll();
+}
+
+/**
+ * @brief Whether variables of a given type can be written straight into memory, see injectVar()
+ *
+ * @param type TI-83+ variable type
+ *
+ * @return
+ */
+bool Calc::canInject(int type) const
+{
+    return VarInjector::isSupported(m_calc, type);
+}
+
+/**
+ * @brief Create or replace a variable without going through the link port
+ *
+ * The loader is run by the emulation thread between two slices, once the
+ * OS is idle (it is given InjectTries slices to get there), or right away
+ * when emulation is stopped, in which case the OS must be idle already.
+ * Blocks until it is done, must not be called from the emulation thread.
+ * Refused while recording or replaying an input log, which could not
+ * reproduce it.
+ *
+ * @param var
+ *
+ * @return
+ */
+bool Calc::injectVar(const VarInjector::Var& var)
+{
+    qDebug() << "Calc: injectVar" << var.name.toHex();
+    if ( !m_calc || m_recording || m_replaying )
+        return false;
+
+    CalcInjection injection(var);
+
+    CalcCommand *c = new CalcCommand(CalcCommand::Inject);
+    c->injection = &injection;
+
+    post(c);
+
+    // emulation may stop (or be stopped) before the next slice, then apply it here as post() does
+    while ( !injection.done.tryAcquire(1, 10) )
+    {
+        if ( !isRunning() && m_run.tryLock() )
+        {
+            beginSlice();
+            m_run.unlock();
+        }
+    }
+
+    if ( !injection.ok )
+        qWarning("Calc: unable to inject variable : %s", qPrintable(injection.error));
+
+    return injection.ok;
+}
+
+int Calc::breakpointCount() const
+{
+    qDebug() << "Calc: breakpointCount";
+    return m_breakIds.count();
+}
+
+void Calc::addBreakpoint(BreakCallback cb)
+{
+    qDebug() << "Calc: addBreakpoint";
+    m_breakIds << tilem_z80_add_breakpoint(m_calc, TILEM_BREAK_MEM_EXEC, 0, 0, -1, cb, 0);
+}
+
+void Calc::removeBreakpoint(int n)
+{
+    qDebug() << "Calc: removeBreakpoint";
+    if ( n >= 0 && n < m_breakIds.count() )
+        tilem_z80_remove_breakpoint(m_calc, m_breakIds.takeAt(n));
+}
+
+int Calc::breakpointType(int n) const
+{
+    qDebug() << "Calc: breakpointType";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    return tilem_z80_get_breakpoint_type(m_calc, id) & TILEM_BREAK_TYPE_MASK;
+}
+
+void Calc::setBreakpointType(int n, int type)
+{
+    qDebug() << "Calc: setBreakpointType";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    int oldtype = tilem_z80_get_breakpoint_type(m_calc, id);
+    type |= oldtype & ~TILEM_BREAK_TYPE_MASK;
+    tilem_z80_set_breakpoint_type(m_calc, id, type);
+}
+
+bool Calc::isBreakpointPhysical(int n) const
+{
+    qDebug() << "Calc: isBreakpointPhysical";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    return tilem_z80_get_breakpoint_type(m_calc, id) & TILEM_BREAK_PHYSICAL;
+}
+
+void Calc::setBreakpointPhysical(int n, bool y)
+{
+    qDebug() << "Calc: setBreakpointPhysical";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    int type = tilem_z80_get_breakpoint_type(m_calc, id);
+
+    if (y)
+        type |= TILEM_BREAK_PHYSICAL;
+    else
+        type &= ~TILEM_BREAK_PHYSICAL;
+
+    tilem_z80_set_breakpoint_type(m_calc, id, type);
+}
+
+dword Calc::breakpointStartAddress(int n) const
+{
+    qDebug() << "Calc: breakpointStartAddress";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    return tilem_z80_get_breakpoint_address_start(m_calc, id);
+}
+
+void Calc::setBreakpointStartAddress(int n, dword a)
+{
+    qDebug() << "Calc: setBreakpointStartAddress";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    tilem_z80_set_breakpoint_address_start(m_calc, id, a);
+}
+
+dword Calc::breakpointEndAddress(int n) const
+{
+    qDebug() << "Calc: breakpointEndAddress";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    return tilem_z80_get_breakpoint_address_end(m_calc, id);
+}
+
+void Calc::setBreakpointEndAddress(int n, dword a)
+{
+    qDebug() << "Calc: setBreakpointEndAddress";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    tilem_z80_set_breakpoint_address_end(m_calc, id, a);
+}
+
+dword Calc::breakpointMaskAddress(int n) const
+{
+    qDebug() << "Calc: breakpointMaskAddress";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    return tilem_z80_get_breakpoint_address_mask(m_calc, id);
+}
+
+void Calc::setBreakpointMaskAddress(int n, dword a)
+{
+    qDebug() << "Calc: setBreakpointMaskAddress";
+    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+
+    tilem_z80_set_breakpoint_address_mask(m_calc, id, a);
+}
+
+/*!
+    \brief Rest calc (simulate battery pull)
+*/
+void Calc::reset()
+{
+    qDebug() << "Calc: reset";
+    post(new CalcCommand(CalcCommand::Reset));
+}
+
+void Calc::doReset()
+{
+    byte keys[8];
+
+    memcpy(keys, m_calc->keypad.keysdown, 8 * sizeof(byte));
+
+    tilem_calc_reset(m_calc);
+
+    memcpy(m_calc->keypad.keysdown, keys, 8 * sizeof(byte));
+}
+
+dword Calc::run_us(int usec)
+{
+    return run(usec, tilem_z80_run_time);
+}
+
+dword Calc::run_cc(int clock)
+{
+    return run(clock, tilem_z80_run);
+}
+
+/**
+ * @brief Run one slice of emulation on behalf of the emulator thread or pool
+ *
+ * In lockstep mode the slice length is a fixed number of clock cycles
+ * (whatever usec says) so that inputs land on the same cycles on replay.
+ *
+ * @param usec Requested slice length
+ * @param emulated Set to the emulated time actually run, in microseconds
+ *
+ * @return the stop reason, as run_us()
+ */
+dword Calc::runSlice(int usec, int *emulated)
+{
+    if ( !m_deterministic )
+    {
+        *emulated = usec;
+        return run_us(usec);
+    }
+
+    if ( !m_sliceCycles )
+        m_sliceCycles = 10 * clockSpeed();
+
+    *emulated = int(qint64(m_sliceCycles) * 1000 / qMax(1, clockSpeed()));
+
+    return run_cc(m_sliceCycles);
+}
+
+dword Calc::run(int amount, emulator emu)
+{
+    QMutexLocker lock(&m_run);
+
+    if ( !m_calc )
+        return -1;
+
+    // everything but the core counts as overhead, see sliceOverhead()
+    QElapsedTimer timer;
+    qint64 core = 0;
+
+    timer.start();
+
+    // inputs are only ever applied between two runs
+    beginSlice();
+
+    // in lockstep mode only bytes captured by beginSlice() reach the calc
+    LinkBuffer& input = m_deterministic ? m_lockstepInput : m_input;
+
+    int remaining = amount;
+    qint64 consumed = 0;
+
+    // whether amounts are clock cycles (or microseconds)
+    const bool cc = emu == tilem_z80_run;
+
+    do
+    {
+        // try to forward data written into input buffer to link port
+
+        if ( !m_link_lock )
+        {
+            if ( input.count() )
+            {
+                m_calc->z80.stop_reason = 0;
+
+                if ( !tilem_linkport_graylink_send_byte(m_calc, input.at(0)) )
+                {
+                    #ifdef TILEM_QT_LINK_DEBUG
+                    printf("@> %02x", static_cast<unsigned char>(input.at(0)));
+                    #endif
+
+                    input.remove(1);
+
+                    if ( !input.count() )
+                        notifyLink();
+
+                    if ( !(m_calc->z80.stop_reason & TILEM_STOP_LINK_WRITE_BYTE) )
+                    {
+                        m_link_lock = true;
+                    } else {
+                        // here's the trick to speed things up : batch processing whenever possible
+                        while ( input.count() && (m_calc->z80.stop_reason & TILEM_STOP_LINK_WRITE_BYTE) )
+                        {
+                            m_calc->z80.stop_reason = 0;
 
-//    selected = options.indexOf(t);
+                            if ( !tilem_linkport_graylink_send_byte(m_calc, input.at(0)) )
+                            {
+                                #ifdef TILEM_QT_LINK_DEBUG
+                                printf(" %02x", static_cast<unsigned char>(input.at(0)));
+                                #endif
+                                input.remove(1);
+                            }
+                        }
 
-    if ( selected != -1 )
-        rom_type = models[selected]->model_id;
+                        if ( !input.count() )
+                            notifyLink();
+                    }
 
-    //qDebug("%c", rom_type);
+                    #ifdef TILEM_QT_LINK_DEBUG
+                    printf("\n");
+                    fflush(stdout);
+                    #endif
+                }
+            } else {
+                int b = tilem_linkport_graylink_get_byte(m_calc);
 
-    m_calc = tilem_calc_new(rom_type);
-    m_table[m_calc] = this;
+                if ( b != -1 )
+                {
+                    // one byte successfully read yay!
 
-    // savefile is NULL
-    tilem_calc_load_state(m_calc, romfile, savefile);
+                    m_output += b;
 
-    // some link emulation magic...
-    m_calc->linkport.linkemu = TILEM_LINK_EMULATOR_GRAY;
-    m_calc->z80.stop_mask &= ~(TILEM_STOP_LINK_READ_BYTE | TILEM_STOP_LINK_WRITE_BYTE | TILEM_STOP_LINK_ERROR);
+                    notifyLink();
 
-    m_broadcast = true;
-    m_link_lock = false;
+                    #ifdef TILEM_QT_LINK_DEBUG
+                    qDebug("@< %02x [%i] [0x%x]", static_cast<unsigned char>(b), m_output.count(), this);
+                    #endif
 
-    // instant LCD state and "composite" LCD state (grayscale is a bitch...)
-    m_lcd = new unsigned char[m_calc->hw.lcdwidth * m_calc->hw.lcdheight / 8];
-    m_lcd_comp = new unsigned int[m_calc->hw.lcdwidth * m_calc->hw.lcdheight];
+                    if ( m_broadcast )
+                        emit bytesAvailable();
+                }
+            }
+        }
 
-    m_calc->lcd.emuflags = TILEM_LCD_REQUIRE_DELAY;
-    m_calc->flash.emuflags = TILEM_FLASH_REQUIRE_DELAY;
+        // stop at the next grayscale sample, see LcdGray
+        const int clock = qMax(1, int(m_calc->z80.clockspeed));
+        const int until = cc ? int(m_sampleIn) : int((m_sampleIn * 1000 + clock - 1) / clock);
+        const int step = qMin(qMax(1, until), remaining);
 
-    fclose(romfile);
+        int left = step;
+        const qint64 start = timer.nsecsElapsed();
 
-//    if ( savefile )
-//        fclose(savefile);
+        dword res = emu(m_calc, step, &left);
 
-    m_load_lock = false;
+        core += timer.nsecsElapsed() - start;
+        consumed += step - left;
+        remaining -= step - left;
 
-    emit fileChanged(romFile());
+        m_sampleIn -= cc ? step - left : qint64(step - left) * clock / 1000;
 
-    if ( !m_link )
-    {
-        m_link = new CalcLink(this, this);
+        if ( m_sampleIn <= 0 )
+            sampleLcd();
 
-//        connect(m_link, SIGNAL( externalLinkGrabbed(bool) ), this, SIGNAL( externalLinkGrabbed(bool) ));
-    } else
-        m_link->setCalc(this);
+        /*
+            some link emulation magic : seamlessly transfer
+            data from buffers to the calc using a virtual
+            graylink to allow asynchronous transfers
+        */
+        if ( res & TILEM_STOP_LINK_WRITE_BYTE )
+        {
+            m_link_lock = false;
+            remaining = qMax(1, remaining);
+        }
 
-    if ( !m_thread )
-    {
-        m_thread = new CalcThread(this, this);
-        connect(m_thread, SIGNAL( started() ), this, SIGNAL( resumed() ) );
-        connect(m_thread, SIGNAL( finished() ), this, SIGNAL( paused() ) );
-        connect(m_thread, SIGNAL( runningChanged(bool) ), this, SIGNAL( paused(bool) ) );
-    }
+        if ( res & TILEM_STOP_LINK_ERROR )
+        {
+            qWarning("@link error.");
+            tilem_linkport_graylink_reset(m_calc);
+            break;
+        }
 
-    /// 3) restart phase
+//         if ( res & TILEM_STOP_INVALID_INST )
+//         {
+//             break;
+//         }
+//
+//         if ( res & TILEM_STOP_UNDOCUMENTED_INST )
+//         {
+//             break;
+//         }
+//
+        if ( res & TILEM_STOP_BREAKPOINT )
+        {
+            emit breakpoint(m_calc->z80.stop_breakpoint);
+            break;
+        }
+    } while ( remaining > 0 );
 
-    // launch emulator thread
-    m_thread->start();
+    m_cycles += cc ? consumed : consumed * m_calc->z80.clockspeed / 1000;
 
-    // start LCD update timer
-    emit loaded();
+    publishSnapshot();
 
-    setModel();
+    m_overheadNs += timer.nsecsElapsed() - core;
+    ++m_runs;
+
+    return m_calc->z80.stop_reason;
 }
 
 /**
- * @brief Save the current state
+ * @brief Whether emulation runs in lockstep mode
  *
- * @param file File to be saved to
+ * @return
  */
-void Calc::save(const QString &file)
+bool Calc::isDeterministic() const
 {
-    qDebug() << "Calc: save to file";
-    QMutexLocker lock(&m_run);
-
-    QFileInfo info(file);
-
-    FILE *romfile, *savefile;
+    return m_deterministic;
+}
 
-    QString savefilename = QDir(info.path()).filePath(info.completeBaseName() + ".sav");
+/**
+ * @brief Switch lockstep mode on or off
+ *
+ * In lockstep mode the result of emulation does not depend on wall-clock
+ * time : key presses, resets and link bytes are queued and only applied
+ * between two slices of a fixed number of clock cycles, which makes them
+ * suitable for recording (see startRecording()).
+ *
+ * @param y
+ */
+void Calc::setDeterministic(bool y)
+{
+    qDebug() << "Calc: setDeterministic" << y;
+    if ( y == m_deterministic )
+        return;
 
-    if ( !(m_calc->hw.flags & TILEM_CALC_HAS_FLASH) )
-    {
-        romfile = NULL;
-    } else if ( !(romfile = fopen(qPrintable(file), "wb")) ) {
-        qWarning(qPrintable(tr("Unable to save ROM file \"%s\": %s")),
-             qPrintable(file), strerror(errno));
-    }
+    if ( !y && (m_recording || m_replaying) )
+        return;
 
-    if ( !(savefile = fopen(qPrintable(savefilename), "wt")) )
-    {
-        qWarning(qPrintable(tr("Unable to save state file \"%s\": %s")),
-             qPrintable(savefilename), strerror(errno));
-    }
+    QMutexLocker lock(&m_run);
 
-    if ( romfile || savefile )
-    {
-        // save state
-        tilem_calc_save_state(m_calc, romfile, savefile);
-    }
+    m_deterministic = y;
+    m_sliceCycles = 0;
 
-    if ( romfile )
-        fclose(romfile);
+    lock.unlock();
 
-    if ( savefile )
-        fclose(savefile);
+    emit deterministicChanged(y);
 }
 
-/*!
-    \return amount of data written to the linkport by the *calc* that can be retrieved using getByte()
-*/
-uint32_t Calc::byteCount() const
+/**
+ * @brief Emulated clock cycles since the last load
+ *
+ * @return
+ */
+quint64 Calc::cycles() const
 {
-    qDebug() << "Calc: byteCount";
-    return m_output.count();
+    return m_cycles;
 }
 
-/*!
-    \brief get a byte from the buffer in which calc linkport writes are stored but does not remove it from the buffer
-*/
-char Calc::topByte()
+bool Calc::isRecording() const
 {
-    qDebug() << "Calc: topByte";
-    if ( m_output.isEmpty() )
-        return 0;
+    return m_recording;
+}
 
-    char c = m_output.at(0);
+bool Calc::isReplaying() const
+{
+    return m_replaying;
+}
 
-    return c;
+QString Calc::lcdExport() const
+{
+    return m_lcdExportName;
 }
 
-/*!
-    \brief get a byte from the buffer in which calc linkport writes are stored
-*/
-char Calc::getByte()
+/**
+ * @brief Publish gray LCD frames into a POSIX shared memory object
+ *
+ * Other processes read them with LcdExportReader, at any rate, without
+ * going through QML or any per frame IPC. The object is (re)created for
+ * every ROM loaded and removed when the export stops.
+ *
+ * @param name Shared memory object name, empty to stop exporting
+ */
+void Calc::setLcdExport(const QString& name)
 {
-    qDebug() << "Calc: getByte";
-    if ( m_output.isEmpty() )
-        return 0;
+    qDebug() << "Calc: setLcdExport" << name;
+    if ( name == m_lcdExportName )
+        return;
 
-    char c = m_output.at(0);
+    m_lcdExportName = name;
 
-    m_output.remove(1);
+    // switched by the emulation thread between two slices, without a ROM load() does it
+    if ( m_calc )
+        post(new CalcCommand(CalcCommand::LcdExport, 0, name));
 
-    return c;
+    emit lcdExportChanged(name);
 }
 
-/*!
-    \brief send a byte to the calc
-*/
-void Calc::sendByte(char c)
+/**
+ * @brief Start recording inputs to an input log
+ *
+ * The current state is saved next to the log (same base name, .rom/.sav)
+ * and reloaded so that the recording and its replays start from exactly
+ * the same state. Lockstep mode is switched on.
+ *
+ * @param file The input log, written by stopRecording()
+ *
+ * @return
+ */
+bool Calc::startRecording(const QString& file)
 {
-    qDebug() << "Calc: sendByte";
-    m_input += c;
-}
+    qDebug() << "Calc: startRecording" << file;
+    if ( !m_calc || m_recording || m_replaying )
+        return false;
 
-/*!
-    \brief get up to n bytes from the buffer in which calc linkport writes are stored
-*/
-QByteArray Calc::getBytes(int n)
-{
-    qDebug() << "Calc: getBytes";
-    if ( n < 0 || m_output.isEmpty() )
-        return QByteArray();
+    QFileInfo info(file);
+    QString rom = QDir(info.path()).filePath(info.completeBaseName() + ".rom");
+    QString sav = QDir(info.path()).filePath(info.completeBaseName() + ".sav");
 
-    n = qMin(n, (int)m_output.count());
+    // only flash models write a ROM, do not pick up a stale one
+    QFile::remove(rom);
 
-    return m_output.take(n);
-}
+    // save synchronously, a paused calc stays paused
+    const bool running = isRunning();
 
-/*!
-    \brief get up to n bytes from the buffer in which calc linkport writes are stored
-*/
-int Calc::getBytes(int n, char *d)
-{
-    qDebug() << "Calc: getBytes";
-    if ( n < 0 || m_output.isEmpty() )
-        return 0;
+    stopEmulation();
+    save(rom);
 
-    n = qMin(n, (int)m_output.count());
+    if ( !QFileInfo(rom).exists() )
+        rom = m_romFile;
 
-    m_output.take(n, d);
+    setDeterministic(true);
 
-    return n;
-}
+    // recording from the very first slice after the load
+    m_run.lock();
+    m_logFile = file;
+    m_log.clear();
+    m_log.setRomFile(rom);
+    m_log.setSliceCycles(m_sliceCycles = 10 * clockSpeed());
+    m_recording = true;
+    m_run.unlock();
 
-/*!
-    \brief send bytes to the calc
-*/
-void Calc::sendBytes(const QByteArray& d)
-{
-    qDebug() << "Calc: sendBytes";
-    m_input += d;
-}
+    emit recordingChanged(true);
 
-int Calc::breakpointCount() const
-{
-    qDebug() << "Calc: breakpointCount";
-    return m_breakIds.count();
-}
+    doLoad(rom, sav, running);
 
-void Calc::addBreakpoint(BreakCallback cb)
-{
-    qDebug() << "Calc: addBreakpoint";
-    m_breakIds << tilem_z80_add_breakpoint(m_calc, TILEM_BREAK_MEM_EXEC, 0, 0, -1, cb, 0);
+    if ( !m_calc )
+    {
+        m_recording = false;
+        m_log.clear();
+        emit recordingChanged(false);
+        return false;
+    }
+
+    return true;
 }
 
-void Calc::removeBreakpoint(int n)
+/**
+ * @brief Stop recording and write the input log
+ *
+ * @return false if the log could not be written
+ */
+bool Calc::stopRecording()
 {
-    qDebug() << "Calc: removeBreakpoint";
-    if ( n >= 0 && n < m_breakIds.count() )
-        tilem_z80_remove_breakpoint(m_calc, m_breakIds.takeAt(n));
+    qDebug() << "Calc: stopRecording";
+    if ( !m_recording )
+        return false;
+
+    QMutexLocker lock(&m_run);
+
+    m_recording = false;
+
+    bool ok = m_log.save(m_logFile);
+
+    m_log.clear();
+
+    lock.unlock();
+
+    emit recordingChanged(false);
+
+    return ok;
 }
 
-int Calc::breakpointType(int n) const
+/**
+ * @brief Replay an input log recorded with startRecording()
+ *
+ * The state saved with the log is loaded and the recorded inputs are
+ * applied on the very same cycles, live inputs are ignored until the end
+ * of the log. Turbo mode can be used to replay faster than real time.
+ *
+ * @param file
+ *
+ * @return
+ */
+bool Calc::replay(const QString& file)
 {
-    qDebug() << "Calc: breakpointType";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    qDebug() << "Calc: replay" << file;
+    if ( m_recording )
+        return false;
 
-    return tilem_z80_get_breakpoint_type(m_calc, id) & TILEM_BREAK_TYPE_MASK;
-}
+    InputLog log;
+
+    if ( !log.load(file) )
+        return false;
 
-void Calc::setBreakpointType(int n, int type)
-{
-    qDebug() << "Calc: setBreakpointType";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    QFileInfo info(file);
+    QString rom = QDir(info.path()).filePath(info.completeBaseName() + ".rom");
+    QString sav = QDir(info.path()).filePath(info.completeBaseName() + ".sav");
 
-    int oldtype = tilem_z80_get_breakpoint_type(m_calc, id);
-    type |= oldtype & ~TILEM_BREAK_TYPE_MASK;
-    tilem_z80_set_breakpoint_type(m_calc, id, type);
-}
+    if ( !QFileInfo(rom).exists() )
+        rom = log.romFile();
 
-bool Calc::isBreakpointPhysical(int n) const
-{
-    qDebug() << "Calc: isBreakpointPhysical";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    stopEmulation();
 
-    return tilem_z80_get_breakpoint_type(m_calc, id) & TILEM_BREAK_PHYSICAL;
-}
+    m_run.lock();
+    m_log = log;
+    m_replayIndex = 0;
+    m_sliceCycles = log.sliceCycles();
+    m_deterministic = true;
+    m_replaying = true;
+    m_run.unlock();
 
-void Calc::setBreakpointPhysical(int n, bool y)
-{
-    qDebug() << "Calc: setBreakpointPhysical";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    emit deterministicChanged(true);
+    emit replayingChanged(true);
 
-    int type = tilem_z80_get_breakpoint_type(m_calc, id);
+    load(rom, sav);
 
-    if (y)
-        type |= TILEM_BREAK_PHYSICAL;
-    else
-        type &= ~TILEM_BREAK_PHYSICAL;
+    if ( !m_calc )
+    {
+        m_replaying = false;
+        emit replayingChanged(false);
+        return false;
+    }
 
-    tilem_z80_set_breakpoint_type(m_calc, id, type);
+    return true;
 }
 
-dword Calc::breakpointStartAddress(int n) const
+/**
+ * @brief Queue a command for the emulation thread and wake it up
+ *
+ * Never blocks : when emulation is not running the command is applied
+ * right away, unless someone else holds the emulator (which then applies
+ * it at the start of its next run anyway).
+ *
+ * @param c
+ */
+void Calc::post(CalcCommand *c)
 {
-    qDebug() << "Calc: breakpointStartAddress";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    if ( c->type != CalcCommand::Save && c->type != CalcCommand::LcdExport )
+        m_lastInput.store(int(m_inputClock.elapsed()));
 
-    return tilem_z80_get_breakpoint_address_start(m_calc, id);
-}
+    m_commands.post(c);
 
-void Calc::setBreakpointStartAddress(int n, dword a)
-{
-    qDebug() << "Calc: setBreakpointStartAddress";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    if ( !isRunning() && m_run.tryLock() )
+    {
+        if ( m_calc )
+            beginSlice();
 
-    tilem_z80_set_breakpoint_address_start(m_calc, id, a);
+        m_run.unlock();
+    }
+
+    wakeUp();
 }
 
-dword Calc::breakpointEndAddress(int n) const
+/**
+ * @brief Apply queued commands and inputs, called with m_run held at the start of every run
+ */
+void Calc::beginSlice()
 {
-    qDebug() << "Calc: breakpointEndAddress";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    CalcCommand *c = m_commands.takeAll();
 
-    return tilem_z80_get_breakpoint_address_end(m_calc, id);
-}
+    // those held back by the previous slice go first
+    if ( m_deferred )
+    {
+        CalcCommand *last = m_deferred;
 
-void Calc::setBreakpointEndAddress(int n, dword a)
-{
-    qDebug() << "Calc: setBreakpointEndAddress";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+        while ( last->next )
+            last = last->next;
 
-    tilem_z80_set_breakpoint_address_end(m_calc, id, a);
-}
+        last->next = c;
+        c = m_deferred;
+        m_deferred = 0;
+    }
 
-dword Calc::breakpointMaskAddress(int n) const
-{
-    qDebug() << "Calc: breakpointMaskAddress";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+    // held back for the next slice, in order
+    CalcCommand *held = 0, *heldTail = 0;
+    bool holdInput = false;
 
-    return tilem_z80_get_breakpoint_address_mask(m_calc, id);
-}
+    while ( c )
+    {
+        CalcCommand *next = c->next;
+        bool hold = false;
 
-void Calc::setBreakpointMaskAddress(int n, dword a)
-{
-    qDebug() << "Calc: setBreakpointMaskAddress";
-    int id = n >= 0 && n < m_breakIds.count() ? m_breakIds.at(n) : 0;
+        if ( c->type == CalcCommand::KeyPress || c->type == CalcCommand::KeyRelease || c->type == CalcCommand::Reset )
+        {
+            // the calc would never see the key down : release it (and keep
+            // the inputs after it in order) once at least a slice has run
+            if ( c->type == CalcCommand::KeyRelease && m_pressCycles.value(c->key, ~quint64(0)) == m_cycles )
+                holdInput = true;
+
+            hold = holdInput;
+        } else if ( c->type == CalcCommand::Inject ) {
+            // the loader needs the OS waiting for a key, a running calc gets a few slices to get there
+            hold = !VarInjector::isIdle(m_calc) && isRunning() && ++c->injection->tries < InjectTries;
+        }
 
-    tilem_z80_set_breakpoint_address_mask(m_calc, id, a);
-}
+        if ( hold )
+        {
+            c->next = 0;
 
-/*!
-    \brief Rest calc (simulate battery pull)
-*/
-void Calc::reset()
-{
-    qDebug() << "Calc: reset";
-    QMutexLocker lock(&m_run);
+            if ( heldTail )
+                heldTail->next = c;
+            else
+                held = c;
 
-    byte keys[8];
+            heldTail = c;
+            c = next;
+            continue;
+        }
 
-    memcpy(keys, m_calc->keypad.keysdown, 8 * sizeof(byte));
+        if ( c->type == CalcCommand::Save )
+        {
+            doSave(c->file);
+        } else if ( c->type == CalcCommand::LcdExport ) {
+            m_lcdExport.close();
+
+            if ( !c->file.isEmpty() )
+                m_lcdExport.create(c->file, m_calc->hw.lcdwidth, m_calc->hw.lcdheight);
+        } else if ( c->type == CalcCommand::Inject ) {
+            CalcInjection *i = c->injection;
+
+            i->ok = VarInjector::inject(m_calc, i->var, &i->error);
+            i->done.release();
+        } else if ( !m_replaying ) {
+            // while replaying the log is authoritative, live inputs are dropped
+            InputLog::Event e;
+            e.cycle = m_cycles;
+            e.type = c->type == CalcCommand::KeyPress ? InputLog::KeyPress :
+                     c->type == CalcCommand::KeyRelease ? InputLog::KeyRelease : InputLog::Reset;
+            e.key = c->key;
+
+            applyInput(e);
+
+            if ( c->type == CalcCommand::KeyPress )
+                m_pressCycles.insert(c->key, m_cycles);
+            else if ( c->type == CalcCommand::KeyRelease )
+                m_pressCycles.remove(c->key);
+
+            if ( m_recording )
+                m_log.append(m_cycles, e.type, e.key);
+        }
 
-    tilem_calc_reset(m_calc);
+        delete c;
+        c = next;
+    }
 
-    memcpy(m_calc->keypad.keysdown, keys, 8 * sizeof(byte));
-}
+    m_deferred = held;
 
-dword Calc::run_us(int usec)
-{
-    return run(usec, tilem_z80_run_time);
-}
+    if ( m_replaying )
+    {
+        while ( m_replayIndex < m_log.count() && m_log.at(m_replayIndex).cycle <= m_cycles )
+            applyInput(m_log.at(m_replayIndex++));
 
-dword Calc::run_cc(int clock)
-{
-    return run(clock, tilem_z80_run);
+        if ( m_replayIndex >= m_log.count() )
+        {
+            m_replaying = false;
+            m_log.clear();
+
+            QMetaObject::invokeMethod(this, "replayingChanged", Qt::QueuedConnection, Q_ARG(bool, false));
+        }
+    } else if ( m_deterministic && m_input.count() ) {
+        // capture whatever the link thread sent so far
+        InputLog::Event e;
+        e.cycle = m_cycles;
+        e.type = InputLog::LinkBytes;
+        e.key = 0;
+        e.data = m_input.take(m_input.count());
+
+        applyInput(e);
+
+        if ( m_recording )
+            m_log.append(m_cycles, e.type, e.key, e.data);
+    }
 }
 
-dword Calc::run(int amount, emulator emu)
+/**
+ * @brief Publish the state of the LCD for other threads, called with m_run held
+ */
+void Calc::publishSnapshot()
 {
-    QMutexLocker lock(&m_run);
+    CalcSnapshot *snap = new CalcSnapshot;
 
-    if ( !m_calc )
-        return -1;
+    snap->width = m_calc->hw.lcdwidth;
+    snap->height = m_calc->hw.lcdheight;
+    snap->lcdOn = m_calc->lcd.active && !(m_calc->z80.halted && !m_calc->poweronhalt);
+    snap->contrast = m_calc->lcd.contrast;
+    snap->halted = m_calc->z80.halted;
+    snap->cycles = m_cycles;
+    snap->lcd = QByteArray(snap->width * snap->height / 8, 0);
 
-    int remaining = amount;
+    if ( snap->lcdOn )
+        (*m_calc->hw.get_lcd)(m_calc, reinterpret_cast<byte*>(snap->lcd.data()));
 
-    do
-    {
-        // try to forward data written into input buffer to link port
+    CalcSnapshotPtr p(snap);
 
-        if ( !m_link_lock )
-        {
-            if ( m_input.count() )
-            {
-                m_calc->z80.stop_reason = 0;
+    // only swap pointers under the lock, the old snapshot dies outside of it
+    m_snapshotLock.lock();
+    m_snapshot.swap(p);
+    m_snapshotLock.unlock();
+}
 
-                if ( !tilem_linkport_graylink_send_byte(m_calc, m_input.at(0)) )
-                {
-                    #ifdef TILEM_QT_LINK_DEBUG
-                    printf("@> %02x", static_cast<unsigned char>(m_input.at(0)));
-                    #endif
+/**
+ * @brief Add the current LCD to the grayscale window, called with m_run held every LcdGray::SampleUsec of emulated time
+ *
+ * Turbo mode samples LcdGray::Samples times less often, gray levels then average over a longer window.
+ */
+void Calc::sampleLcd()
+{
+    // in turbo mode a sample every window length : a turbo slice is then a
+    // handful of core runs rather than one per SampleUsec
+    const int usec = isTurbo() ? LcdGray::SampleUsec * LcdGray::Samples : LcdGray::SampleUsec;
 
-                    m_input.remove(1);
+    m_sampleIn += qint64(m_calc->z80.clockspeed) * usec / 1000;
 
-                    if ( !(m_calc->z80.stop_reason & TILEM_STOP_LINK_WRITE_BYTE) )
-                    {
-                        m_link_lock = true;
-                    } else {
-                        // here's the trick to speed things up : batch processing whenever possible
-                        while ( m_input.count() && (m_calc->z80.stop_reason & TILEM_STOP_LINK_WRITE_BYTE) )
-                        {
-                            m_calc->z80.stop_reason = 0;
+    byte *bits = reinterpret_cast<byte*>(m_sample.data());
 
-                            if ( !tilem_linkport_graylink_send_byte(m_calc, m_input.at(0)) )
-                            {
-                                #ifdef TILEM_QT_LINK_DEBUG
-                                printf(" %02x", static_cast<unsigned char>(m_input.at(0)));
-                                #endif
-                                m_input.remove(1);
-                            }
-                        }
-                    }
+    // same test as the snapshots : a blank LCD samples as all white
+    if ( m_calc->lcd.active && !(m_calc->z80.halted && !m_calc->poweronhalt) )
+        (*m_calc->hw.get_lcd)(m_calc, bits);
+    else
+        memset(bits, 0, m_sample.size());
 
-                    #ifdef TILEM_QT_LINK_DEBUG
-                    printf("\n");
-                    fflush(stdout);
-                    #endif
-                }
-            } else {
-                int b = tilem_linkport_graylink_get_byte(m_calc);
+    if ( !m_gray.sample(bits) )
+        return;
 
-                if ( b != -1 )
-                {
-                    // one byte successfully read yay!
+    // the slot is never shared, data() does not copy
+    LcdFrame& f = m_frames.back();
 
-                    m_output += b;
+    m_gray.levels(reinterpret_cast<unsigned char*>(f.gray.data()));
+    m_gray.reset(f.gray.size());
 
-                    #ifdef TILEM_QT_LINK_DEBUG
-                    qDebug("@< %02x [%i] [0x%x]", static_cast<unsigned char>(b), m_output.count(), this);
-                    #endif
+    f.sequence = ++m_frameSequence;
+    f.hash = lcd_hash(f.gray);
 
-                    if ( m_broadcast )
-                        emit bytesAvailable();
-                }
-            }
-        }
+    m_lcdExport.publish(f.gray, f.sequence, m_cycles);
 
-        dword res = emu(m_calc, remaining, &remaining);
+    m_frames.publish();
+}
 
-        /*
-            some link emulation magic : seamlessly transfer
-            data from buffers to the calc using a virtual
-            graylink to allow asynchronous transfers
-        */
-        if ( res & TILEM_STOP_LINK_WRITE_BYTE )
-        {
-            m_link_lock = false;
-            remaining = qMax(1, remaining);
-        }
+/**
+ * @brief Latest state published by the emulation thread
+ *
+ * @return the snapshot, null when no ROM is loaded
+ */
+CalcSnapshotPtr Calc::snapshot() const
+{
+    QMutexLocker l(&m_snapshotLock);
+    return m_snapshot;
+}
 
-        if ( res & TILEM_STOP_LINK_ERROR )
-        {
-            qWarning("@link error.");
-            tilem_linkport_graylink_reset(m_calc);
+void Calc::applyInput(const InputLog::Event& e)
+{
+    switch ( e.type )
+    {
+        case InputLog::KeyPress:
+            tilem_keypad_press_key(m_calc, e.key);
             break;
-        }
 
-//         if ( res & TILEM_STOP_INVALID_INST )
-//         {
-//             break;
-//         }
-//
-//         if ( res & TILEM_STOP_UNDOCUMENTED_INST )
-//         {
-//             break;
-//         }
-//
-        if ( res & TILEM_STOP_BREAKPOINT )
-        {
-            emit breakpoint(m_calc->z80.stop_breakpoint);
+        case InputLog::KeyRelease:
+            tilem_keypad_release_key(m_calc, e.key);
             break;
-        }
-    } while ( remaining > 0 );
 
-    return m_calc->z80.stop_reason;
+        case InputLog::LinkBytes:
+            m_lockstepInput += e.data;
+            break;
+
+        case InputLog::Reset:
+            doReset();
+            break;
+    }
 }
 
 /**
@@ -889,64 +2288,90 @@ void Calc::stop(int reason)
  */
 bool Calc::lcdUpdate()
 {
-    if ( m_load_lock || !m_calc )
+    if ( m_load_lock || !m_lcd_level )
         return false;
 
-    // low : black, high : white
-    unsigned int low, high;
-    const int cc = int(m_calc->lcd.contrast);
-    const unsigned int end = m_calc->hw.lcdheight * m_calc->hw.lcdwidth;
+    // in turbo mode only composite at the configured frame rate
+    if ( isTurbo() && m_frameClock.isValid() && m_frameClock.elapsed() < turboFrameInterval() )
+        return false;
 
-    // contrast determination
-    if ( m_calc->lcd.active && !(m_calc->z80.halted && !m_calc->poweronhalt) )
-    {
-        // update "plain" LCD data
-        (*m_calc->hw.get_lcd)(m_calc, m_lcd);
+    // latest complete frame, without locking nor waiting for the emulation thread
+    if ( !m_frames.update() )
+        return false;
 
-        /*
-            LCD behaves roughly as follows :
+    const LcdFrame& f = m_frames.front();
 
-            0->31 : high is white, low goes from white to black
-            32->63 : low is black, high goes from white to black
-        */
-        const int c = 63 - cc;
-        //low = qMin(31, c) / 8  + qMax(0, c - 31) * 4;
-        //high = qMax(31, c) * 4 + qMin(0, c - 31) / 8;
-
-        low = 0x00;
-        high = 0xff;
-
-//         if ( c < 32 ) {
-//             low = 0;
-//             high = c * 8;
-//         } else {
-//             low = (c - 32) * 8;
-//             high = 255;
-//         }
-    } else {
-        low = high = 0xff;
-    }
+    // same frame, or same picture, as last time : nothing to do
+    if ( f.sequence == m_lcdSequence || f.hash == m_lcdHash )
+        return false;
 
-    // update "composite" LCD data
-    bool changed = false;
+    m_lcdSequence = f.sequence;
+    m_lcdHash = f.hash;
 
-    for ( unsigned int idx = 0; idx < end; ++idx )
-    {
-        unsigned int v = m_lcd[idx >> 3] & (0x80 >> (idx & 7)) ? low : high;
+    if ( isTurbo() )
+        m_frameClock.start();
+
+    /*
+        Contrast is not emulated : the LCD is black on white when on and
+        white when off. Gray levels come ready-made from the emulation
+        thread, see sampleLcd().
+    */
+    const unsigned char *gray = reinterpret_cast<const unsigned char*>(f.gray.constData());
 
-        // blending for grayscale
-        unsigned int g = v + ((qRed(m_lcd_comp[idx]) - v) * 7) / 8;
+    const int count = f.width * f.height;
+    const int tiles = (count + 15) / 16;
+
+    m_lcdDirty.fill(0, tiles);
+    m_dirtyRects.clear();
+
+    unsigned char *dirty = reinterpret_cast<unsigned char*>(m_lcdDirty.data());
+
+    if ( !LcdGray::update(gray, m_lcd_level, dirty, count) )
+        return false;
 
-        v = qRgb(g, g, g);
+    // turn changed groups of 16 pixels into row runs, then runs into bands
+    for ( int k = 0; k < tiles; ++k )
+    {
+        if ( !dirty[k] )
+            continue;
 
-        if ( v != m_lcd_comp[idx] )
+        for ( int p = k * 16, e = qMin(p + 16, count); p < e; )
         {
-            changed = true;
-            m_lcd_comp[idx] = v;
+            const int y = p / f.width, x = p % f.width;
+            const int n = qMin(e - p, f.width - x);
+
+            add_dirty_run(m_dirtyRects, x, y, n);
+
+            p += n;
         }
     }
 
-    return changed;
+    merge_dirty_rows(m_dirtyRects);
+
+    return true;
+}
+
+/**
+ * @brief Parts of the LCD changed by the last lcdUpdate() that returned true
+ *
+ * @return rectangles in LCD pixels
+ */
+QVector<QRect> Calc::lcdDirtyRects() const
+{
+    return m_dirtyRects;
+}
+
+/**
+ * @brief Plain (non composited) LCD content
+ *
+ * @return lcdWidth() * lcdHeight() pixels, 1 bit per pixel, MSB first, set bits are dark
+ */
+QByteArray Calc::lcdBits()
+{
+    CalcSnapshotPtr snap = snapshot();
+
+    // blank when the LCD is off
+    return snap ? snap->lcd : QByteArray();
 }
 
 /**
@@ -969,6 +2394,27 @@ int Calc::lcdHeight() const
     return m_calc ? m_calc->hw.lcdheight : 0;
 }
 
+/**
+ * @brief Calc emulating a given libtilemcore calc
+ *
+ * Safe to call from any thread.
+ *
+ * @param calc
+ *
+ * @return the Calc, 0 if none
+ */
+Calc* Calc::fromTilem(TilemCalc *calc)
+{
+    QReadLocker l(&m_tableLock);
+    return m_table.value(calc, 0);
+}
+
+void Calc::unregisterCalc()
+{
+    QWriteLocker l(&m_tableLock);
+    m_table.remove(m_calc);
+}
+
 void Calc::setModel()
 {
     qDebug() << "QmlCalc: setModel";
@@ -976,9 +2422,16 @@ void Calc::setModel()
     emit modelDescriptionChanged(modelDescription());
 }
 
-const unsigned int* Calc::lcdData() const
+/**
+ * @brief Composite LCD content
+ *
+ * Colours are left to the renderer, see CalcScreen::lcdBlack and CalcScreen::lcdWhite.
+ *
+ * @return lcdWidth() * lcdHeight() intensities, 0 is black and 255 white
+ */
+const unsigned char* Calc::lcdGray() const
 {
-    return m_lcd_comp;
+    return m_lcd_level;
 }
 
 /*
@@ -1077,7 +2530,7 @@ extern "C" void tilem_message(TilemCalc* calc, const char* msg, ...)
     va_list ap;
     va_start(ap, msg);
 
-    Calc *c = Calc::m_table.value(calc, 0);
+    Calc *c = Calc::fromTilem(calc);
 
     if ( false )
     {
@@ -1098,7 +2551,7 @@ extern "C" void tilem_warning(TilemCalc* calc, const char* msg, ...)
     va_list ap;
     va_start(ap, msg);
 
-    Calc *c = Calc::m_table.value(calc, 0);
+    Calc *c = Calc::fromTilem(calc);
 
     if ( c )
     {
@@ -1119,7 +2572,7 @@ extern "C" void tilem_internal(TilemCalc* calc, const char* msg, ...)
     va_list ap;
     va_start(ap, msg);
 
-    Calc *c = Calc::m_table.value(calc, 0);
+    Calc *c = Calc::fromTilem(calc);
 
     if ( c )
     {
@@ -21,27 +21,43 @@
 */
 
 #include "linkbuffer.h"
+#include "inputlog.h"
+#include "lcdgray.h"
+#include "lcdframe.h"
+#include "lcdexport.h"
+#include "varinjector.h"
+#include "calccommand.h"
+#include "calcsnapshot.h"
 #include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <tilem.h>
 
+#include <QAtomicInt>
+#include <QAtomicInteger>
 #include <QHash>
+#include <QRect>
+#include <QVector>
 #include <QObject>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QReadWriteLock>
 #include <QStringList>
 
 class QScriptEngine;
 class CalcLink;
 class CalcThread;
+class EmulatorPool;
 class QMimeData;
 
 class Calc : public QObject
 {
     friend class CalcLink;
+    friend class CalcThread;
+    friend class EmulatorPool;
     friend class CalcDebugger;
 
     friend const char *tilem_gettext(const char *msg);
@@ -55,6 +71,21 @@ class Calc : public QObject
         Q_PROPERTY(QString name READ name WRITE load NOTIFY nameChanged)
         Q_PROPERTY(QString modelName READ modelName NOTIFY modelNameChanged)
         Q_PROPERTY(QString modelDescription READ modelDescription NOTIFY modelDescriptionChanged)
+        Q_PROPERTY(qreal speed READ speed WRITE setSpeed NOTIFY speedChanged)
+        Q_PROPERTY(int catchUpLimit READ catchUpLimit WRITE setCatchUpLimit NOTIFY catchUpLimitChanged)
+        Q_PROPERTY(bool turbo READ isTurbo WRITE setTurbo NOTIFY turboChanged)
+        Q_PROPERTY(int turboFrameInterval READ turboFrameInterval WRITE setTurboFrameInterval NOTIFY turboFrameIntervalChanged)
+        Q_PROPERTY(qreal emulatedMHz READ emulatedMHz NOTIFY emulatedMHzChanged)
+        Q_PROPERTY(int sliceLength READ sliceLength WRITE setSliceLength NOTIFY sliceLengthChanged)
+        Q_PROPERTY(bool autoSlice READ isAutoSlice WRITE setAutoSlice NOTIFY autoSliceChanged)
+        Q_PROPERTY(int currentSlice READ currentSlice NOTIFY currentSliceChanged)
+        Q_PROPERTY(qreal sliceOverhead READ sliceOverhead NOTIFY sliceOverheadChanged)
+        Q_PROPERTY(bool frameDriven READ isFrameDriven WRITE setFrameDriven NOTIFY frameDrivenChanged)
+        Q_PROPERTY(bool pooled READ isPooled WRITE setPooled NOTIFY pooledChanged)
+        Q_PROPERTY(bool deterministic READ isDeterministic WRITE setDeterministic NOTIFY deterministicChanged)
+        Q_PROPERTY(bool recording READ isRecording NOTIFY recordingChanged)
+        Q_PROPERTY(bool replaying READ isReplaying NOTIFY replayingChanged)
+        Q_PROPERTY(QString lcdExport READ lcdExport WRITE setLcdExport NOTIFY lcdExportChanged)
 
     public:
         enum LogLevel
@@ -73,12 +104,36 @@ class Calc : public QObject
         Q_INVOKABLE void releaseKey(int keycode);
         Q_INVOKABLE QStringList guessRomType(QString url);
 
+        Q_INVOKABLE bool startRecording(const QString& file);
+        Q_INVOKABLE bool stopRecording();
+        Q_INVOKABLE bool replay(const QString& file);
+
         CalcLink* link() const;
 
         bool isValid();
 
         bool isPaused() const;
         bool isRunning() const;
+        bool isHalted() const;
+        bool isIdle() const;
+        bool isPoweredOff() const;
+
+        bool waitForWakeUp(qint64 usec);
+
+        EmulatorPool* pool() const;
+        void setPool(EmulatorPool *pool);
+
+        bool isPooled() const;
+
+        static Calc* fromTilem(TilemCalc *calc);
+
+        bool isDeterministic() const;
+        bool isRecording() const;
+        bool isReplaying() const;
+
+        quint64 cycles() const;
+
+        QString lcdExport() const;
 
         QString name() const;
 
@@ -88,12 +143,34 @@ class Calc : public QObject
 
         QString romFile() const;
 
+        qreal speed() const;
+        int catchUpLimit() const;
+
+        bool isTurbo() const;
+        int turboFrameInterval() const;
+
+        qreal emulatedMHz() const;
+        int clockSpeed() const;
+
+        int sliceLength() const;
+        bool isAutoSlice() const;
+
+        int currentSlice() const;
+        qreal sliceOverhead() const;
+
+        bool isBusy() const;
+
+        bool isFrameDriven() const;
+
         void sendFile();
 
         bool lcdUpdate();
+        QByteArray lcdBits();
+        CalcSnapshotPtr snapshot() const;
         int lcdWidth() const;
         int lcdHeight() const;
-        const unsigned int* lcdData() const;
+        const unsigned char* lcdGray() const;
+        QVector<QRect> lcdDirtyRects() const;
 
         void resetLink();
 
@@ -115,6 +192,13 @@ class Calc : public QObject
         int getBytes(int n, char *d);
         void sendBytes(const QByteArray& d);
 
+        bool waitForDrained(int msec, const QAtomicInt *abort = 0);
+        bool waitForBytes(uint32_t count, int msec, const QAtomicInt *abort = 0);
+        void abortLinkWaits();
+
+        bool canInject(int type) const;
+        bool injectVar(const VarInjector::Var& var);
+
         int breakpointCount() const;
 
         void addBreakpoint(BreakCallback cb);
@@ -138,11 +222,32 @@ class Calc : public QObject
     public slots:
         dword run_us(int usec);
         dword run_cc(int clock);
+        dword runSlice(int usec, int *emulated);
+        dword runFrame(int usec, int budget);
 
         void stop(int reason = 0);
 
+        void wakeUp();
+
         void setName(const QString& n);
 
+        void setSpeed(qreal speed);
+        void setCatchUpLimit(int msec);
+
+        void setTurbo(bool y);
+        void setTurboFrameInterval(int msec);
+
+        void setSliceLength(int usec);
+        void setAutoSlice(bool y);
+
+        void setFrameDriven(bool y);
+
+        void setPooled(bool y);
+
+        void setDeterministic(bool y);
+
+        void setLcdExport(const QString& name);
+
         void step();
         void pause();
         void resume();
@@ -151,6 +256,7 @@ class Calc : public QObject
         void save();
 
         void load(const QString& file);
+        void load(const QString& file, const QString& state);
         void save(const QString& file);
 
     Q_SIGNALS:
@@ -164,6 +270,21 @@ class Calc : public QObject
         void nameChanged(QString name);
         void modelNameChanged(QString model);
         void modelDescriptionChanged(QString modelDescription);
+        void speedChanged(qreal speed);
+        void catchUpLimitChanged(int catchUpLimit);
+        void turboChanged(bool turbo);
+        void turboFrameIntervalChanged(int turboFrameInterval);
+        void emulatedMHzChanged(qreal emulatedMHz);
+        void sliceLengthChanged(int sliceLength);
+        void autoSliceChanged(bool autoSlice);
+        void currentSliceChanged(int currentSlice);
+        void sliceOverheadChanged(qreal sliceOverhead);
+        void frameDrivenChanged(bool frameDriven);
+        void pooledChanged(bool pooled);
+        void deterministicChanged(bool deterministic);
+        void recordingChanged(bool recording);
+        void replayingChanged(bool replaying);
+        void lcdExportChanged(const QString& lcdExport);
 
         void bytesAvailable();
 
@@ -172,6 +293,23 @@ class Calc : public QObject
 
     private:
         void setModel();
+        void setEmulatedMHz(qreal mhz);
+        void updateSliceStats(int current);
+
+        void stopEmulation();
+        void startEmulation();
+
+        void unregisterCalc();
+
+        void doReset();
+        void doSave(const QString& file);
+        void doLoad(const QString& file, const QString& state, bool start);
+
+        void post(CalcCommand *c);
+        void beginSlice();
+        void publishSnapshot();
+        void sampleLcd();
+        void applyInput(const InputLog::Event& e);
 
         typedef dword (*emulator)(TilemCalc *c, int amount, int *remaining);
         dword run(int amount, emulator emu);
@@ -183,17 +321,101 @@ class Calc : public QObject
 
         QList<int> m_breakIds;
 
-        unsigned char *m_lcd;
-        unsigned int *m_lcd_comp;
+        unsigned char *m_lcd_level;
+
+        // changed groups of 16 pixels and their rectangles, see lcdDirtyRects()
+        QByteArray m_lcdDirty;
+        QVector<QRect> m_dirtyRects;
+
+        // sequence number and hash of the last frame shown
+        quint64 m_lcdSequence, m_lcdHash;
+
+        // gray frames, from the emulation thread to lcdUpdate()
+        LcdFrameQueue m_frames;
+
+        // grayscale accumulation, on the emulation thread : sample buffer,
+        // last frame sequence number and clock cycles until the next sample
+        LcdGray m_gray;
+        QByteArray m_sample;
+        quint64 m_frameSequence;
+        qint64 m_sampleIn;
+
+        // gray frames for other processes, see setLcdExport()
+        QString m_lcdExportName;
+        LcdExport m_lcdExport;
+
+        // LCD state as of the end of the last slice
+        mutable QMutex m_snapshotLock;
+        CalcSnapshotPtr m_snapshot;
+
+        // commands for the emulation thread
+        CalcCommandQueue m_commands;
+
+        // held back until the next slice, oldest first, and the cycle each key went down on (m_run)
+        CalcCommand *m_deferred;
+        QHash<int, quint64> m_pressCycles;
 
         volatile bool m_load_lock, m_link_lock, m_broadcast;
 
+        // shared with the emulation thread (or pool workers), speeds are stored as the bits of a double
+        QAtomicInteger<quint64> m_speed;
+        QAtomicInt m_catchUpLimit;
+
+        QAtomicInt m_turbo;
+        QAtomicInt m_turboFrameInterval;
+        QElapsedTimer m_frameClock;
+
+        QAtomicInteger<quint64> m_mhz;
+
+        // slice tuning, see SliceTuner
+        volatile int m_sliceLength;
+        volatile bool m_autoSlice;
+        QAtomicInt m_currentSlice;
+        QAtomicInteger<quint64> m_sliceOverhead;
+
+        // accumulated by run(), under m_run
+        int m_runs;
+        qint64 m_overheadNs;
+
+        QElapsedTimer m_inputClock;
+        QAtomicInt m_lastInput;
+
+        // display driven emulation
+        bool m_frameDriven;
+        volatile bool m_frameRunning;
+
         LinkBuffer m_input, m_output;
 
+        // lockstep mode
+        volatile bool m_deterministic, m_recording, m_replaying;
+        quint64 m_cycles;
+        int m_sliceCycles;
+
+        LinkBuffer m_lockstepInput;
+
+        InputLog m_log;
+        QString m_logFile;
+        int m_replayIndex;
+
+        // wakeup of the emulator between slices
+        QMutex m_wakeLock;
+        QWaitCondition m_wake;
+        bool m_woken;
+
+        // link threads waiting for input to drain or output to come, see waitForBytes()
+        QMutex m_linkWaitLock;
+        QWaitCondition m_linkWait;
+        QAtomicInt m_linkWaiters;
+
+        bool waitForLink(uint32_t count, int msec, const QAtomicInt *abort);
+        void notifyLink();
+
         static QHash<TilemCalc*, Calc*> m_table;
+        static QReadWriteLock m_tableLock;
 
         CalcLink *m_link;
         CalcThread *m_thread;
+        EmulatorPool *m_pool;
 };
 
 #endif
@@ -0,0 +1,134 @@
+#ifndef CALCCOMMAND_H
+#define CALCCOMMAND_H
+
+#include "varinjector.h"
+
+#include <QAtomicPointer>
+#include <QSemaphore>
+#include <QString>
+
+/*!
+    \class CalcInjection
+    \brief A variable for CalcCommand::Inject, whoever posted it waits on done
+*/
+struct CalcInjection
+{
+    CalcInjection(const VarInjector::Var& v)
+     : var(v), ok(false), tries(0)
+    {
+    }
+
+    VarInjector::Var var;
+
+    bool ok;
+    QString error;
+
+    // slices waited for the OS to go idle
+    int tries;
+
+    QSemaphore done;
+};
+
+/*!
+    \class CalcCommand
+    \brief A request for the emulation thread, applied between two slices
+*/
+struct CalcCommand
+{
+    enum Type
+    {
+        KeyPress,
+        KeyRelease,
+        Reset,
+        Save,
+        LcdExport,
+        Inject
+    };
+
+    CalcCommand(Type t, int k = 0, const QString& f = QString())
+     : type(t), key(k), file(f), injection(0), next(0)
+    {
+    }
+
+    Type type;
+    int key;
+    QString file;
+
+    // Inject only, owned by the poster
+    CalcInjection *injection;
+
+    CalcCommand *next;
+};
+
+/*!
+    \class CalcCommandQueue
+    \brief Lock-free queue of CalcCommand, many producers and one consumer
+
+    Producers (GUI, link or scripting threads) push onto an atomic stack,
+    which never blocks nor waits for the emulation thread. The consumer
+    grabs the whole stack at once and reverses it to restore posting order.
+*/
+class CalcCommandQueue
+{
+    public:
+        CalcCommandQueue()
+         : m_head(0)
+        {
+        }
+
+        ~CalcCommandQueue()
+        {
+            CalcCommand *c = takeAll();
+
+            while ( c )
+            {
+                CalcCommand *next = c->next;
+                delete c;
+                c = next;
+            }
+        }
+
+        bool isEmpty() const
+        {
+            return !m_head.loadAcquire();
+        }
+
+        /*!
+            \brief Queue a command, ownership is transferred to the queue
+        */
+        void post(CalcCommand *c)
+        {
+            CalcCommand *head;
+
+            do
+            {
+                head = m_head.loadAcquire();
+                c->next = head;
+            } while ( !m_head.testAndSetRelease(head, c) );
+        }
+
+        /*!
+            \brief Take all queued commands, oldest first, ownership goes to the caller
+        */
+        CalcCommand* takeAll()
+        {
+            CalcCommand *c = m_head.fetchAndStoreAcquire(0), *list = 0;
+
+            while ( c )
+            {
+                CalcCommand *next = c->next;
+                c->next = list;
+                list = c;
+                c = next;
+            }
+
+            return list;
+        }
+
+    private:
+        Q_DISABLE_COPY(CalcCommandQueue)
+
+        QAtomicPointer<CalcCommand> m_head;
+};
+
+#endif // CALCCOMMAND_H
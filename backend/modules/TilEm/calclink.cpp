@@ -20,93 +20,222 @@
 */
 
 #include "calc.h"
+#include "linktransfer.h"
 
-#include <unistd.h>
-
-#include <QQueue>
 #include <QThread>
 #include <QStringList>
 #include <QTimerEvent>
 #include <QMutex>
+#include <QDir>
+#include <QFile>
+#include <QRegExp>
 
 #ifdef _TILEM_QT_HAS_LINK_
 static int get_calc_model(TilemCalc* calc);
 static CableHandle* external_link_handle_new();
-static CableHandle* internal_link_handle_new(Calc *calc);
+static CableHandle* internal_link_handle_new(CalcLink *link);
 static int send_file(CalcHandle* ch, int last, const char* filename);
+static bool inject_file(Calc *calc, CalcModel model, const char *filename);
+static int receive_dump(CalcHandle *ch, LinkTransfer *t);
 #endif
 
-static volatile int _link_abort = 0;
-
 /*!
 	\internal
 	\class FileSender
-	\brief Utility class to send files to the calculator
+	\brief Utility class to send files to the calculator, and receive dumps from it
 	
 	The point of this class is to abstract away file sending using tilibs
-	and to thread it to avoid GUI freeze. 
+	and to thread it to avoid GUI freeze. Each CalcLink has its own, so
+	transfers to different calcs run concurrently while those to the same
+	calc are sent in order. The thread only runs while its queue is not
+	empty.
 */
 class FileSender : public QThread
 {
 	public:
 		FileSender(CalcLink *l)
-		 : QThread(0), m_link(l)
+		 : QThread(0), m_link(l), m_current(0), m_active(false)
 		{
 		}
 		
+		/*
+			Cancel every queued transfer, and the one in progress
+		*/
 		void abort()
 		{
-			_link_abort = 1;
+			m_lock.lock();
+			QList<LinkTransfer*> l = m_queue;
+			LinkTransfer *current = m_current;
+			m_queue.clear();
+			m_lock.unlock();
+			
+			foreach ( LinkTransfer *t, l )
+				drop(t);
+			
+			// finished and released by run()
+			if ( current )
+				current->cancel();
 		}
 		
-		void send(const QString& s)
+		/*
+			Cancel a transfer that is still queued, false if run() took it already
+		*/
+		bool unqueue(LinkTransfer *t)
 		{
 			m_lock.lock();
-			m_files.enqueue(s);
+			bool queued = m_queue.removeOne(t);
 			m_lock.unlock();
 			
-			if ( !isRunning() )
-				start();
+			if ( queued )
+				drop(t);
+			
+			return queued;
+		}
+		
+		void queue(LinkTransfer *t)
+		{
+			QMutexLocker l(&m_lock);
+			
+			m_queue << t;
+			
+			if ( m_active )
+				return;
+			
+			m_active = true;
+			
+			l.unlock();
+			
+			// the previous run may still be returning
+			wait();
+			start();
+		}
+		
+		bool isActive() const
+		{
+			QMutexLocker l(&m_lock);
+			return m_active;
+		}
+		
+		LinkTransfer* current() const
+		{
+			QMutexLocker l(&m_lock);
+			return m_current;
 		}
 		
 	protected:
 		virtual void run()
 		{
-			while ( !_link_abort && m_files.count() )
+			forever
 			{
 				m_lock.lock();
-				QString f = m_files.dequeue();
-				m_lock.unlock();
 				
-				#ifdef _TILEM_QT_HAS_LINK_
-				// avoid conflicts with calc2calc direct connections
-				bool broadcast = m_link->m_calc->isBroadcasting();
-				bool extlink = m_link->hasExternalLink();
+				if ( m_queue.isEmpty() )
+				{
+					m_active = false;
+					m_lock.unlock();
+					
+					// queued : by the time it is delivered isSending() may be true again
+					QMetaObject::invokeMethod(m_link, "transfersDone", Qt::QueuedConnection);
+					break;
+				}
+				
+				LinkTransfer *t = m_queue.takeFirst();
 				
-				// prevent extlink from randomly messing with transfer
-				if ( extlink )
-					m_link->releaseExternalLink();
+				// the last of a row of sends
+				bool last = true;
 				
-				// TODO : first wait for any exchange using direct connection to end...
-				m_link->m_calc->setBroadcasting(false);
+				foreach ( LinkTransfer *n, m_queue )
+					if ( n->direction() == LinkTransfer::Send )
+						last = false;
 				
-				if ( !_link_abort )
-					send_file(m_link->m_ch, m_files.isEmpty(), f.toLocal8Bit().constData());
+				m_current = t;
+				m_lock.unlock();
 				
-				m_link->m_calc->setBroadcasting(broadcast);
+				// sent on behalf of CalcLink::send(QString), nobody else holds it
+				const bool owned = t->parent() == m_link;
 				
-				if ( extlink )
-					m_link->grabExternalLink();
+				if ( t->begin() )
+				{
+					LinkTransfer::State state = LinkTransfer::Failed;
+					QString error = QObject::tr("Link support is not available");
+					
+					#ifdef _TILEM_QT_HAS_LINK_
+					// avoid conflicts with calc2calc direct connections
+					bool broadcast = m_link->m_calc->isBroadcasting();
+					bool extlink = m_link->hasExternalLink();
+					
+					// prevent extlink from randomly messing with transfer
+					if ( extlink )
+						m_link->releaseExternalLink();
+					
+					// TODO : first wait for any exchange using direct connection to end...
+					m_link->m_calc->setBroadcasting(false);
+					
+					int err = t->direction() == LinkTransfer::Receive
+						? receive_dump(m_link->m_ch, t)
+						: send_file(m_link->m_ch, last, t->file().toLocal8Bit().constData())
+						;
+					
+					m_link->m_calc->setBroadcasting(broadcast);
+					
+					if ( extlink )
+						m_link->grabExternalLink();
+					
+					if ( t->isCancelled() )
+					{
+						// do not leave half a packet behind for the next transfer
+						m_link->m_calc->resetLink();
+						state = LinkTransfer::Cancelled;
+						error.clear();
+					} else if ( err ) {
+						error = t->direction() == LinkTransfer::Receive
+							? QObject::tr("Unable to receive into %1").arg(t->file())
+							: QObject::tr("Unable to send %1").arg(t->file())
+							;
+					} else {
+						state = LinkTransfer::Done;
+						error.clear();
+					}
+					#endif
+					
+					// the owner may delete it as soon as it is finished
+					m_lock.lock();
+					m_current = 0;
+					m_lock.unlock();
+					
+					t->finish(state, error);
+				} else {
+					m_lock.lock();
+					m_current = 0;
+					m_lock.unlock();
+					
+					// cancelled between the queue and begin()
+					t->finish(LinkTransfer::Cancelled);
+				}
 				
-				#endif
+				if ( owned )
+					t->deleteLater();
 			}
 		}
 		
 	private:
+		/*
+			Out of the queue for good : run() never sees it
+		*/
+		void drop(LinkTransfer *t)
+		{
+			t->finish(LinkTransfer::Cancelled);
+			
+			if ( t->parent() == m_link )
+				t->deleteLater();
+		}
+		
 		CalcLink *m_link;
 		
-		QMutex m_lock;
-		QQueue<QString> m_files;
+		mutable QMutex m_lock;
+		QList<LinkTransfer*> m_queue;
+		LinkTransfer *m_current;
+		bool m_active;
 };
 
 /*!
@@ -156,6 +285,7 @@ CalcLink::~CalcLink()
 	
 	m_sender->abort();
 	m_sender->wait();
+	delete m_sender;
 	
 	setCalc(0);
 	
@@ -306,6 +436,10 @@ void CalcLink::timerEvent(QTimerEvent *e)
 void CalcLink::setCalc(Calc *c)
 {
 	#ifdef _TILEM_QT_HAS_LINK_
+	// same calc with another state loaded (e.g. batch dumps) : keep the session
+	if ( c && c == m_calc && m_ch && m_ch->model == get_calc_model(c->m_calc) )
+		return;
+	
 	if ( m_calc )
 	{
 		ticalcs_cable_detach(m_ch);
@@ -323,7 +457,7 @@ void CalcLink::setCalc(Calc *c)
 	
 	if ( m_calc )
 	{
-		m_cbl = internal_link_handle_new(c);
+		m_cbl = internal_link_handle_new(this);
 		
 		if ( !m_cbl )
 		{
@@ -372,9 +506,81 @@ bool CalcLink::isSupportedFile(const QString& file) const
 	return false;
 }
 
+/*!
+	\brief Queue a file, see TransferManager to follow its progress
+*/
 void CalcLink::send(const QString& f)
 {
-	m_sender->send(f);
+	queue(new LinkTransfer(m_calc, f, this));
+}
+
+/*!
+	\brief Queue a transfer, in either direction, run after those queued before
+*/
+void CalcLink::queue(LinkTransfer *t)
+{
+	m_sender->queue(t);
+}
+
+/*!
+	\brief Cancel a transfer queued on this link, see LinkTransfer::cancel()
+	
+	\return false if it is not queued (any more), e.g. because it is running
+*/
+bool CalcLink::unqueue(LinkTransfer *t)
+{
+	return m_sender->unqueue(t);
+}
+
+/*!
+	\brief Cancel every transfer queued on this link, and the one in progress
+*/
+void CalcLink::abort()
+{
+	m_sender->abort();
+}
+
+/*!
+	\brief Load a file, writing its variables straight into memory when possible
+	
+	Much faster than send() for test fixtures, see VarInjector. Files that
+	cannot be injected as a whole (apps, OS, backups, some variable types or
+	calc models) are queued with send() instead, as are all files while a
+	transfer is in progress so that they arrive in order.
+	
+	\return whether the file was injected, false if it was queued for a link transfer
+*/
+bool CalcLink::inject(const QString& f)
+{
+	#ifdef _TILEM_QT_HAS_LINK_
+	if ( m_calc && !isSending() && inject_file(m_calc, m_ch->model, f.toLocal8Bit().constData()) )
+		return true;
+	#endif
+	
+	send(f);
+	
+	return false;
+}
+
+/*!
+	\return whether files queued with send() are still being transferred
+*/
+bool CalcLink::isSending() const
+{
+	return m_sender->isActive();
+}
+
+/*!
+	\return the transfer in progress, if any
+*/
+LinkTransfer* CalcLink::currentTransfer() const
+{
+	return m_sender->current();
+}
+
+Calc* CalcLink::calc() const
+{
+	return m_calc;
 }
 
 #ifdef _TILEM_QT_HAS_LINK_
@@ -415,16 +621,47 @@ int get_calc_model(TilemCalc *calc)
 
 static int ilp_reset(CableHandle* cbl)
 {
-	Calc *calc = static_cast<Calc*>(cbl->priv);
+	CalcLink *link = static_cast<CalcLink*>(cbl->priv);
 	
-	calc->resetLink();
+	link->calc()->resetLink();
 	
 	return 0;
 }
 
+/*
+	Wait for the calc to drain its input (count == 0) or to write count
+	bytes. The cable timeout (in 1/10 s) runs in emulated time : a paused
+	calc never times out, a turbo one times out sooner. Cancelling the
+	transfer in progress breaks the wait.
+*/
+static bool ilp_wait(CableHandle *cbl, CalcLink *link, uint32_t count)
+{
+	Calc *calc = link->calc();
+	LinkTransfer *t = link->currentTransfer();
+	const QAtomicInt *abort = t ? t->abortFlag() : 0;
+	
+	const quint64 start = calc->cycles();
+	const quint64 limit = quint64(qMax(1, cbl->timeout)) * 100 * calc->clockSpeed();
+	
+	forever
+	{
+		// woken up by the emulation thread as soon as something moves
+		bool done = count
+			? calc->waitForBytes(count, 100, abort)
+			: calc->waitForDrained(100, abort)
+			;
+		
+		if ( done )
+			return true;
+		
+		if ( (abort && abort->load()) || calc->cycles() - start >= limit )
+			return false;
+	}
+}
+
 static int ilp_send(CableHandle *cbl, uint8_t *data, uint32_t count)
 {
-	Calc *calc = static_cast<Calc*>(cbl->priv);
+	CalcLink *link = static_cast<CalcLink*>(cbl->priv);
 	
 	#ifdef TILEM_QT_LINK_DEBUG
 	printf("<");
@@ -437,49 +674,33 @@ static int ilp_send(CableHandle *cbl, uint8_t *data, uint32_t count)
 	fflush(stdout);
 	#endif
 	
-	QByteArray d;
-	d.resize(count);
+	link->calc()->sendBytes(QByteArray(reinterpret_cast<const char*>(data), count));
 	
-	for ( uint32_t i = 0; i < count; ++i )
-		d[i] = data[i];
+	// wait for bytes to be processed...
+	if ( !ilp_wait(cbl, link, 0) )
+		return ERROR_WRITE_TIMEOUT;
 	
-	calc->sendBytes(d);
+	LinkTransfer *t = link->currentTransfer();
 	
-	// wait for bytes to be processed...
-	while ( calc->isReceiving() )
-	{
-		if ( _link_abort )
-			return ERROR_WRITE_TIMEOUT;
-		
-		usleep(1000);
-	}
+	if ( t && t->direction() == LinkTransfer::Send )
+		t->addBytes(count);
 	
 	return 0;
 }
 
 static int ilp_recv(CableHandle *cbl, uint8_t *data, uint32_t count)
 {
-	Calc *calc = static_cast<Calc*>(cbl->priv);
+	CalcLink *link = static_cast<CalcLink*>(cbl->priv);
 	
-	uint32_t newc, oldc = calc->byteCount();
+	if ( !ilp_wait(cbl, link, count) )
+		return ERROR_READ_TIMEOUT;
 	
-	while ( oldc < count )
-	{
-		qDebug("%i/%i [0x%x]", oldc, count, quintptr(calc));
-		
-		do
-		{
-			if ( _link_abort )
-				return ERROR_READ_TIMEOUT;
-			
-			usleep(1000);
-			newc = calc->byteCount();
-		} while ( newc <= oldc );
-		
-		oldc = newc;
-	}
+	link->calc()->getBytes(count, reinterpret_cast<char*>(data));
 	
-	calc->getBytes(count, reinterpret_cast<char*>(data));
+	LinkTransfer *t = link->currentTransfer();
+	
+	if ( t && t->direction() == LinkTransfer::Receive )
+		t->addBytes(count);
 	
 	#ifdef TILEM_QT_LINK_DEBUG
 	printf(">");
@@ -497,7 +718,7 @@ static int ilp_recv(CableHandle *cbl, uint8_t *data, uint32_t count)
 
 static int ilp_check(CableHandle* cbl, int* status)
 {
-	Calc *calc = static_cast<Calc*>(cbl->priv);
+	Calc *calc = static_cast<CalcLink*>(cbl->priv)->calc();
 	
 	*status = STATUS_NONE;
 	
@@ -509,13 +730,13 @@ static int ilp_check(CableHandle* cbl, int* status)
 	return 0;
 }
 
-static CableHandle* internal_link_handle_new(Calc *calc)
+static CableHandle* internal_link_handle_new(CalcLink *link)
 {
 	CableHandle *cbl = ticables_handle_new(CABLE_ILP, PORT_0);
 	
 	if ( cbl )
 	{
-		cbl->priv = calc;
+		cbl->priv = link;
 		cbl->cable->reset = ilp_reset;
 		cbl->cable->send = ilp_send;
 		cbl->cable->recv = ilp_recv;
@@ -567,6 +788,166 @@ static int print_tilibs_error(int errcode)
 	return errcode;
 }
 
+/*
+	Inject every variable of a regular file, false if any of them cannot be
+*/
+static bool inject_file(Calc *calc, CalcModel model, const char *filename)
+{
+	switch ( tifiles_file_get_class(filename) )
+	{
+		case TIFILE_SINGLE:
+		case TIFILE_GROUP:
+		case TIFILE_REGULAR:
+			break;
+			
+		default:
+			return false;
+	}
+	
+	FileContent *filec = tifiles_content_create_regular(model);
+	int err = tifiles_file_read_regular(filename, filec);
+	
+	if ( err )
+	{
+		print_tilibs_error(err);
+		tifiles_content_delete_regular(filec);
+		return false;
+	}
+	
+	// all or nothing, a partial group would then be sent again anyway
+	bool ok = true;
+	
+	for ( int i = 0; ok && i < filec->num_entries; ++i )
+		ok = calc->canInject(filec->entries[i]->type);
+	
+	for ( int i = 0; ok && i < filec->num_entries; ++i )
+	{
+		const VarEntry *e = filec->entries[i];
+		
+		VarInjector::Var v;
+		v.type = e->type;
+		v.name = QByteArray(e->name, qstrnlen(e->name, 8));
+		v.data = QByteArray(reinterpret_cast<const char*>(e->data), e->size);
+		v.archived = e->attr == ATTRB_ARCHIVED;
+		
+		ok = calc->injectVar(v);
+	}
+	
+	tifiles_content_delete_regular(filec);
+	
+	return ok;
+}
+
+/*
+	Entries of a dirlist tree (root, folders, then variables or apps) whose
+	file name matches the filter
+*/
+static void collect_entries(GNode *tree, CalcModel model, const QRegExp& filter, QList<VarEntry*>& entries, qint64 *total)
+{
+	if ( !tree )
+		return;
+	
+	for ( guint i = 0; i < g_node_n_children(tree); ++i )
+	{
+		GNode *folder = g_node_nth_child(tree, i);
+		
+		for ( guint j = 0; j < g_node_n_children(folder); ++j )
+		{
+			VarEntry *ve = static_cast<VarEntry*>(g_node_nth_child(folder, j)->data);
+			
+			if ( !ve )
+				continue;
+			
+			char *name = tifiles_build_filename(model, ve);
+			
+			if ( filter.exactMatch(QFile::decodeName(name)) )
+			{
+				entries << ve;
+				*total += ve->size;
+			}
+			
+			g_free(name);
+		}
+	}
+}
+
+/*
+	Receive what a transfer asks for into its directory. Variables and apps
+	are requested one at a time and each is written to its own file before
+	the next one : memory use is bounded by the largest of them.
+*/
+static int receive_dump(CalcHandle *ch, LinkTransfer *t)
+{
+	QDir dir(t->file());
+	
+	if ( !dir.mkpath(".") )
+	{
+		fprintf(stderr, "Unable to create %s\n", qPrintable(t->file()));
+		return -1;
+	}
+	
+	int err = 0;
+	
+	if ( t->contents() & LinkTransfer::Backup )
+	{
+		QString f = dir.filePath(QString("backup.%1").arg(tifiles_fext_of_backup(ch->model)));
+		
+		err = ticalcs_calc_recv_backup2(ch, QFile::encodeName(f).constData());
+		
+		if ( err )
+			return print_tilibs_error(err);
+		
+		t->addFile(f);
+	}
+	
+	if ( !(t->contents() & (LinkTransfer::Variables | LinkTransfer::Apps)) || t->isCancelled() )
+		return 0;
+	
+	GNode *vars = 0, *apps = 0;
+	
+	err = ticalcs_calc_get_dirlist(ch, &vars, &apps);
+	
+	if ( err )
+		return print_tilibs_error(err);
+	
+	const QRegExp filter(t->filter(), Qt::CaseInsensitive, QRegExp::Wildcard);
+	
+	QList<VarEntry*> variables, applications;
+	qint64 total = 0;
+	
+	if ( t->contents() & LinkTransfer::Variables )
+		collect_entries(vars, ch->model, filter, variables, &total);
+	
+	if ( t->contents() & LinkTransfer::Apps )
+		collect_entries(apps, ch->model, filter, applications, &total);
+	
+	t->setBytesTotal(total);
+	
+	const QList<VarEntry*> entries = variables + applications;
+	
+	for ( int i = 0; !err && i < entries.count() && !t->isCancelled(); ++i )
+	{
+		VarEntry *ve = entries.at(i);
+		
+		char *name = tifiles_build_filename(ch->model, ve);
+		QString f = dir.filePath(QFile::decodeName(name));
+		g_free(name);
+		
+		err = i < variables.count()
+			? ticalcs_calc_recv_var2(ch, MODE_NORMAL, QFile::encodeName(f).constData(), ve)
+			: ticalcs_calc_recv_app2(ch, QFile::encodeName(f).constData(), ve)
+			;
+		
+		if ( !err )
+			t->addFile(f);
+	}
+	
+	ticalcs_dirlist_destroy(&vars);
+	ticalcs_dirlist_destroy(&apps);
+	
+	return print_tilibs_error(err);
+}
+
 static int send_file(CalcHandle *ch, int last, const char *filename)
 {
 	CalcMode mode;
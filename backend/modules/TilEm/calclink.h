@@ -29,6 +29,7 @@
 
 class Calc;
 class FileSender;
+class LinkTransfer;
 
 class CalcLink : public QObject
 {
@@ -44,6 +45,11 @@ class CalcLink : public QObject
 		
 		bool isSupportedFile(const QString& file) const;
 		
+		bool isSending() const;
+		LinkTransfer* currentTransfer() const;
+		
+		Calc* calc() const;
+		
 	public slots:
 		void grabExternalLink();
 		void releaseExternalLink();
@@ -51,9 +57,15 @@ class CalcLink : public QObject
 		void setCalc(Calc *c);
 		
 		void send(const QString& file);
+		void queue(LinkTransfer *t);
+		bool unqueue(LinkTransfer *t);
+		bool inject(const QString& file);
+		
+		void abort();
 		
 	Q_SIGNALS:
 		void externalLinkGrabbed(bool y);
+		void transfersDone();
 		
 	protected:
 		virtual void timerEvent(QTimerEvent *e);
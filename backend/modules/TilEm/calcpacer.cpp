@@ -0,0 +1,70 @@
+#include "calcpacer.h"
+
+#include <QtGlobal>
+
+CalcPacer::CalcPacer()
+    : m_due(0), m_speed(1.0), m_catchUpLimit(100000)
+{
+    reset();
+}
+
+/**
+ * @brief Restart pacing from the current host time
+ *
+ * Any backlog or advance accumulated so far is forgotten.
+ */
+void CalcPacer::reset()
+{
+    m_clock.start();
+    m_due = 0;
+}
+
+/**
+ * @brief Emulation speed relative to real hardware
+ *
+ * @return 1.0 for real hardware speed
+ */
+qreal CalcPacer::speed() const
+{
+    return m_speed;
+}
+
+void CalcPacer::setSpeed(qreal speed)
+{
+    m_speed = qMax(qreal(0.01), speed);
+}
+
+/**
+ * @brief Maximum amount of host time the emulator may catch up after a stall
+ *
+ * @return limit in microseconds
+ */
+int CalcPacer::catchUpLimit() const
+{
+    return m_catchUpLimit;
+}
+
+void CalcPacer::setCatchUpLimit(int usec)
+{
+    m_catchUpLimit = qMax(0, usec);
+}
+
+/**
+ * @brief Account for a slice of emulated time
+ *
+ * @param usec Emulated microseconds that were just run
+ *
+ * @return Host microseconds to wait before running the next slice
+ */
+qint64 CalcPacer::advance(int usec)
+{
+    m_due += qRound64(usec / m_speed);
+
+    const qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    // drop the part of the backlog we are not allowed to catch up on
+    if ( now - m_due > m_catchUpLimit )
+        m_due = now - m_catchUpLimit;
+
+    return qMax(qint64(0), m_due - now);
+}
@@ -0,0 +1,39 @@
+#ifndef CALCPACER_H
+#define CALCPACER_H
+
+#include <QElapsedTimer>
+
+/*!
+    \class CalcPacer
+    \brief Keeps emulated time in step with a monotonic host clock
+
+    Every slice of emulated time is accounted for with advance(), which
+    answers how long the caller should wait before running the next slice.
+    When the host falls behind (stall, heavy load) the pacer lets the
+    emulator catch up by running slices back-to-back, but never more than
+    catchUpLimit() worth of backlog: anything beyond that is dropped.
+*/
+class CalcPacer
+{
+    public:
+        CalcPacer();
+
+        void reset();
+
+        qreal speed() const;
+        void setSpeed(qreal speed);
+
+        int catchUpLimit() const;
+        void setCatchUpLimit(int usec);
+
+        qint64 advance(int usec);
+
+    private:
+        QElapsedTimer m_clock;
+
+        qint64 m_due;
+        qreal m_speed;
+        int m_catchUpLimit;
+};
+
+#endif // CALCPACER_H
@@ -1,28 +1,98 @@
 #include "calcscreen.h"
 
 #include <QThread>
-#include <QPainter>
+#include <QQuickWindow>
+#include <QScreen>
+#include <QSGSimpleTextureNode>
+#include <QStandardPaths>
+#include <QDateTime>
+#include <QDir>
+
 #include <QDebug>
 
 #include "calc.h"
+#include "framerecorder.h"
+
+/*!
+    \internal
+    \brief Texture node owning its texture, replaced whenever the LCD changed
+*/
+class LcdNode : public QSGSimpleTextureNode
+{
+    public:
+        ~LcdNode()
+        {
+            delete texture();
+        }
+
+        void replaceTexture(QSGTexture *t)
+        {
+            QSGTexture *old = texture();
+
+            setTexture(t);
+            delete old;
+        }
+};
 
 CalcScreen::CalcScreen(QQuickItem *parent) :
-    QQuickPaintedItem(parent), m_calc(NULL)
+    QQuickItem(parent), m_calc(NULL), m_textureDirty(false), m_lcdTimerId(0), m_frameSync(false),
+    m_lcdBlack(Qt::black), m_lcdWhite(Qt::white), m_recorder(new FrameRecorder(this))
 {
-//    setFillColor(Qt::color1);
-    connect(this, SIGNAL( widthChanged() ), this, SLOT( setLcd() ));
-    connect(this, SIGNAL( heightChanged() ), this, SLOT( setLcd() ));
+    setFlag(ItemHasContents, true);
+
+    setPalette();
+
+    connect(m_recorder, SIGNAL( saved(QString) ), this, SIGNAL( saved(QString) ));
+
+    // the node follows the item size, nothing to redraw on the CPU side
+    connect(this, SIGNAL( widthChanged() ), this, SLOT( update() ));
+    connect(this, SIGNAL( heightChanged() ), this, SLOT( update() ));
 }
 
 CalcScreen::~CalcScreen()
 {
 }
 
-void CalcScreen::paint(QPainter *painter)
+/**
+ * @brief Upload the LCD if it changed and let the scene graph scale it to the item
+ *
+ * Runs on the render thread while the GUI thread is blocked, so m_screen can
+ * be read safely.
+ *
+ * @param old
+ * @param data
+ *
+ * @return
+ */
+QSGNode* CalcScreen::updatePaintNode(QSGNode *old, UpdatePaintNodeData *data)
 {
-    QRectF target = contentsBoundingRect();
-    QRectF source(0.0, 0.0, m_lcdW, m_lcdH);
-    painter->drawImage(target,m_screen,source);
+    Q_UNUSED(data)
+
+    LcdNode *node = static_cast<LcdNode*>(old);
+
+    if ( m_screen.isNull() || width() <= 0 || height() <= 0 )
+    {
+        delete node;
+        return 0;
+    }
+
+    if ( !node )
+    {
+        node = new LcdNode;
+        m_textureDirty = true;
+    }
+
+    if ( m_textureDirty )
+    {
+        node->replaceTexture(window()->createTextureFromImage(m_screen));
+        m_textureDirty = false;
+    }
+
+    // keep the pixels sharp whatever the scale
+    node->setFiltering(QSGTexture::Nearest);
+    node->setRect(boundingRect());
+
+    return node;
 }
 
 Calc *CalcScreen::calc() const
@@ -30,27 +100,132 @@ Calc *CalcScreen::calc() const
     return m_calc;
 }
 
-void CalcScreen::setLcd()
+void CalcScreen::fileLoaded()
 {
-    if(m_lcdW == (int)width() && m_lcdH == (int)height())
+    qDebug() << "fileLoaded";
+
+    /*
+        load() resets the LCD levels the dirty rects are diffed against,
+        repaint them all or the previous ROM stays wherever it differs
+    */
+    drawLCD();
+
+    // start LCD update timer, or the frame loop
+    if ( m_frameSync )
+        resumeFrames();
+    else
+        startLcdTimer();
+}
+
+void CalcScreen::beforeFileLoaded()
+{
+    stopLcdTimer();
+
+    // the GIF has the size of the old LCD, which may not outlive the load
+    stopCapture();
+}
+
+void CalcScreen::startLcdTimer()
+{
+    if ( !m_lcdTimerId )
+        m_lcdTimerId = startTimer(10);
+}
+
+void CalcScreen::stopLcdTimer()
+{
+    if ( m_lcdTimerId )
+        killTimer(m_lcdTimerId);
+
+    m_lcdTimerId = 0;
+}
+
+bool CalcScreen::frameSync() const
+{
+    return m_frameSync;
+}
+
+/**
+ * @brief Drive emulation from the display instead of polling the LCD every 10 ms
+ *
+ * After every frame shown, exactly the emulated time elapsed since the
+ * previous one is run (see Calc::runFrame()) and the LCD is composited
+ * once, so nothing is composited that is never displayed.
+ *
+ * @param y
+ */
+void CalcScreen::setFrameSync(bool y)
+{
+    if ( y == m_frameSync )
         return;
-    m_lcdW = (int)width();
-    m_lcdH = (int)height();
-    qDebug() << "setLcd: " << m_lcdW << "x" << m_lcdH;
-    m_screen = QImage(m_lcdW,m_lcdH, QImage::Format_RGB32);
-    updateLCD();
+
+    m_frameSync = y;
+
+    if ( m_calc )
+    {
+        m_calc->setFrameDriven(y);
+
+        if ( y )
+            stopLcdTimer();
+        else if ( m_calc->isValid() )
+            startLcdTimer();
+    }
+
+    resumeFrames();
+
+    emit frameSyncChanged(y);
 }
 
-void CalcScreen::fileLoaded()
+void CalcScreen::resumeFrames()
 {
-    qDebug() << "fileLoaded";
-    // start LCD update timer
-    m_lcdTimerId = startTimer(10);
+    if ( !m_frameSync )
+        return;
+
+    // the first frame after a pause runs a nominal frame of emulated time
+    m_frameClock.invalidate();
+
+    if ( m_window )
+        m_window->update();
 }
 
-void CalcScreen::beforeFileLoaded()
+void CalcScreen::itemChange(ItemChange change, const ItemChangeData &value)
 {
-    killTimer(m_lcdTimerId);
+    if ( change == ItemSceneChange )
+        watchWindow(value.window);
+
+    QQuickItem::itemChange(change, value);
+}
+
+void CalcScreen::watchWindow(QQuickWindow *w)
+{
+    if ( m_window )
+        disconnect(m_window, SIGNAL( frameSwapped() ), this, SLOT( frameSwapped() ));
+
+    m_window = w;
+
+    // emitted from the render thread with the threaded render loop
+    if ( m_window )
+        connect(m_window, SIGNAL( frameSwapped() ), this, SLOT( frameSwapped() ), Qt::QueuedConnection);
+}
+
+void CalcScreen::frameSwapped()
+{
+    if ( !m_frameSync || !m_calc || !m_calc->isValid() )
+        return;
+
+    // one frame worth of emulated time, bounded so a stall does not freeze the GUI
+    int usec = m_frameClock.isValid() ? int(m_frameClock.nsecsElapsed() / 1000) : 16667;
+    m_frameClock.restart();
+
+    // emulation runs on this thread : leave it half a refresh interval at most
+    const qreal hz = m_window && m_window->screen() ? m_window->screen()->refreshRate() : 60;
+
+    m_calc->runFrame(qBound(1000, usec, 50000), int(500000 / qMax(qreal(1), hz)));
+
+    updateLCD();
+
+    // keep frames (and thus emulation) coming
+    if ( m_window && m_calc->isRunning() )
+        m_window->update();
 }
 
 void CalcScreen::timerEvent(QTimerEvent *e)
@@ -58,7 +233,7 @@ void CalcScreen::timerEvent(QTimerEvent *e)
     if ( e->timerId() == m_lcdTimerId )
         updateLCD();
     else
-        QQuickPaintedItem::timerEvent(e);
+        QQuickItem::timerEvent(e);
 }
 
 void CalcScreen::setCalc(Calc *arg)
@@ -68,38 +243,189 @@ void CalcScreen::setCalc(Calc *arg)
         m_calc = arg;
         connect(m_calc, SIGNAL(loaded()), this, SLOT( fileLoaded() ));
         connect(m_calc, SIGNAL(beginLoad()), this, SLOT( beforeFileLoaded() ));
+        connect(m_calc, SIGNAL(resumed()), this, SLOT( resumeFrames() ));
+        m_calc->setFrameDriven(m_frameSync);
         emit calcChanged(arg);
     }
 }
 
-void CalcScreen::takeScreenshot()
+/**
+ * @brief Save the LCD as a PNG image at its native resolution, in the background
+ *
+ * @param file Image to write, a time stamped file in the pictures folder if empty
+ */
+void CalcScreen::takeScreenshot(const QString& file)
+{
+    const unsigned char *gray = m_calc ? m_calc->lcdGray() : 0;
+
+    if ( !gray )
+        return;
+
+    m_recorder->screenshot(captureFile(file, "png"), gray, m_calc->lcdWidth(), m_calc->lcdHeight(), m_palette);
+}
+
+bool CalcScreen::isCapturing() const
+{
+    return m_recorder->isCapturing();
+}
+
+/**
+ * @brief Record every LCD update into an animated GIF until stopCapture()
+ *
+ * @param file GIF to write, a time stamped file in the pictures folder if empty
+ */
+void CalcScreen::startCapture(const QString& file)
+{
+    const unsigned char *gray = m_calc ? m_calc->lcdGray() : 0;
+
+    if ( !gray )
+        return;
+
+    const bool was = m_recorder->isCapturing();
+
+    if ( !m_recorder->start(captureFile(file, "gif"), m_calc->lcdWidth(), m_calc->lcdHeight(), m_palette) )
+        return;
+
+    // first frame : what is on screen right now
+    m_recorder->addFrame(gray, m_calc->lcdWidth(), m_calc->lcdHeight());
+
+    if ( !was )
+        emit capturingChanged(true);
+}
+
+void CalcScreen::stopCapture()
 {
+    if ( !m_recorder->isCapturing() )
+        return;
 
+    m_recorder->stop();
+
+    emit capturingChanged(false);
+}
+
+QString CalcScreen::captureFile(const QString& file, const QString& suffix)
+{
+    if ( !file.isEmpty() )
+        return file;
+
+    QDir dir(QStandardPaths::writableLocation(QStandardPaths::PicturesLocation));
+
+    return dir.filePath(QString("tilem-%1.%2").arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss-zzz"), suffix));
 }
 
 void CalcScreen::updateLCD()
 {
     if( m_calc->lcdUpdate()) {
-        const int w = m_calc->lcdWidth();
-        const int h = m_calc->lcdHeight();
+        foreach ( const QRect& r, m_calc->lcdDirtyRects() )
+            drawLCD(r);
 
-        QRgb *d = reinterpret_cast<QRgb*>(m_screen.bits());
-        const unsigned int *cd = m_calc->lcdData();
+        // a GIF cannot change size midway
+        if ( !m_recorder->addFrame(m_calc->lcdGray(), m_calc->lcdWidth(), m_calc->lcdHeight()) )
+            stopCapture();
+    }
+    else if(!m_calc->isValid() && !m_screen.isNull() ) {
+        m_screen = QImage();
+        update();
+    }
+}
 
-        // write LCD into skin image
-        for ( int i = 0; i < m_lcdH; ++i )
-        {
-            for ( int j = 0; j < m_lcdW; ++j )
-            {
-                int y = (h * i) / m_lcdH;
-                int x = (w * j) / m_lcdW;
+/**
+ * @brief Colour part of the LCD into the native size screen image and schedule a new texture
+ *
+ * @param src Area of the LCD, in LCD pixels, the whole LCD if null or if the image had to be
+ * (re)allocated
+ */
+void CalcScreen::drawLCD(const QRect& src)
+{
+    const unsigned char *cd = m_calc ? m_calc->lcdGray() : 0;
 
-                d[i * m_lcdW + j] = cd[y * w + x];
-            }
-        }
-        update(boundingRect().toAlignedRect());
+    if ( !cd )
+        return;
+
+    const int w = m_calc->lcdWidth();
+    const int h = m_calc->lcdHeight();
+
+    // the model may have changed since the last frame, a new image is not initialised
+    const bool fresh = m_screen.size() != QSize(w, h);
+
+    if ( fresh )
+        m_screen = QImage(w, h, QImage::Format_RGB32);
+
+    const QRect r = src.isNull() || fresh ? m_screen.rect() : src & m_screen.rect();
+    const QRgb *pal = m_palette.constData();
+
+    // colours are only applied here
+    for ( int y = r.top(); y <= r.bottom(); ++y )
+    {
+        const unsigned char *s = cd + y * w;
+        QRgb *line = reinterpret_cast<QRgb*>(m_screen.scanLine(y));
+
+        for ( int x = r.left(); x <= r.right(); ++x )
+            line[x] = pal[s[x]];
     }
-    else if(!m_calc->isValid() ) {
-        m_screen.fill(Qt::transparent);
+
+    m_textureDirty = true;
+    update();
+}
+
+QColor CalcScreen::lcdBlack() const
+{
+    return m_lcdBlack;
+}
+
+/**
+ * @brief Colour of dark LCD pixels, usually bound to Skin::lcdBlack
+ *
+ * @param c
+ */
+void CalcScreen::setLcdBlack(const QColor& c)
+{
+    if ( c == m_lcdBlack )
+        return;
+
+    m_lcdBlack = c;
+    setPalette();
+
+    emit lcdBlackChanged(c);
+}
+
+QColor CalcScreen::lcdWhite() const
+{
+    return m_lcdWhite;
+}
+
+/**
+ * @brief Colour of blank LCD pixels, usually bound to Skin::lcdWhite
+ *
+ * @param c
+ */
+void CalcScreen::setLcdWhite(const QColor& c)
+{
+    if ( c == m_lcdWhite )
+        return;
+
+    m_lcdWhite = c;
+    setPalette();
+
+    emit lcdWhiteChanged(c);
+}
+
+void CalcScreen::setPalette()
+{
+    m_palette.resize(256);
+
+    const QRgb b = m_lcdBlack.rgb(), w = m_lcdWhite.rgb();
+
+    for ( int g = 0; g < 256; ++g )
+    {
+        m_palette[g] = qRgb(
+                qRed(b) + (qRed(w) - qRed(b)) * g / 255,
+                qGreen(b) + (qGreen(w) - qGreen(b)) * g / 255,
+                qBlue(b) + (qBlue(w) - qBlue(b)) * g / 255
+            );
     }
+
+    // recolour what is already there
+    if ( m_calc && m_calc->isValid() )
+        drawLCD();
 }
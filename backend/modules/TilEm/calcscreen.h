@@ -1,26 +1,52 @@
 #ifndef CALCSCREEN_H
 #define CALCSCREEN_H
 
-#include <QQuickPaintedItem>
+#include <QQuickItem>
 #include <QImage>
+#include <QColor>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QPointer>
 
 class Settings;
 
 class Calc;
 class CalcLink;
-
-class CalcScreen : public QQuickPaintedItem
+class QQuickWindow;
+class QSGNode;
+class FrameRecorder;
+
+/*!
+    \class CalcScreen
+    \brief Displays the LCD of a Calc
+
+    Only the LCD at its native resolution (96x64 or 128x64) is coloured on
+    the CPU and uploaded as a texture, the scene graph scales it to the item
+    size with nearest filtering. This works the same with the OpenGL and the
+    software scene graph backends.
+*/
+class CalcScreen : public QQuickItem
 {
     Q_OBJECT
     Q_PROPERTY(Calc* calc READ calc WRITE setCalc NOTIFY calcChanged)
+    Q_PROPERTY(bool frameSync READ frameSync WRITE setFrameSync NOTIFY frameSyncChanged)
+    Q_PROPERTY(QColor lcdBlack READ lcdBlack WRITE setLcdBlack NOTIFY lcdBlackChanged)
+    Q_PROPERTY(QColor lcdWhite READ lcdWhite WRITE setLcdWhite NOTIFY lcdWhiteChanged)
+    Q_PROPERTY(bool capturing READ isCapturing NOTIFY capturingChanged)
 
 public:
     CalcScreen(QQuickItem *parent = 0);
     ~CalcScreen();
-    void paint(QPainter *painter);
 
     Calc* calc() const;
 
+    bool frameSync() const;
+
+    QColor lcdBlack() const;
+    QColor lcdWhite() const;
+
+    bool isCapturing() const;
+
 //    virtual QSize sizeHint() const;
 
     bool isPaused() const;
@@ -29,6 +55,9 @@ public:
 
 Q_SIGNALS:
     void calcChanged(Calc* calc);
+    void frameSyncChanged(bool frameSync);
+    void lcdBlackChanged(QColor lcdBlack);
+    void lcdWhiteChanged(QColor lcdWhite);
 
     void paused();
     void resumed();
@@ -37,14 +66,22 @@ Q_SIGNALS:
 
     void externalLinkGrabbed(bool externalLinkGrabbed);
 
+    void capturingChanged(bool capturing);
+    void saved(const QString& file);
+
 public slots:
     void setCalc(Calc* arg);
+    void setFrameSync(bool y);
 
-    void takeScreenshot();
+    void setLcdBlack(const QColor& c);
+    void setLcdWhite(const QColor& c);
 
-    void updateLCD();
+    void takeScreenshot(const QString& file = QString());
 
-    void setLcd();
+    void startCapture(const QString& file = QString());
+    void stopCapture();
+
+    void updateLCD();
 
     void fileLoaded();
     void beforeFileLoaded();
@@ -52,15 +89,40 @@ public slots:
 
 
 protected:
+    QSGNode* updatePaintNode(QSGNode *old, UpdatePaintNodeData *data);
     void timerEvent(QTimerEvent *e);
+    void itemChange(ItemChange change, const ItemChangeData &value);
+
+private slots:
+    void frameSwapped();
+    void resumeFrames();
 
 private:
     Calc* m_calc;
+    // native LCD, the texture is only re-created when it changed
     QImage m_screen;
-
-    int m_lcdX, m_lcdY, m_lcdW, m_lcdH;
+    bool m_textureDirty;
 
     int m_lcdTimerId;
+
+    void startLcdTimer();
+    void stopLcdTimer();
+
+    void drawLCD(const QRect& src = QRect());
+    void setPalette();
+    void watchWindow(QQuickWindow *w);
+
+    bool m_frameSync;
+    QElapsedTimer m_frameClock;
+    QPointer<QQuickWindow> m_window;
+
+    // LCD intensity (0 black, 255 white) to colour
+    QColor m_lcdBlack, m_lcdWhite;
+    QVector<QRgb> m_palette;
+
+    FrameRecorder *m_recorder;
+
+    static QString captureFile(const QString& file, const QString& suffix);
 };
 
 #endif // CALCSCREEN_H
@@ -0,0 +1,31 @@
+#ifndef CALCSNAPSHOT_H
+#define CALCSNAPSHOT_H
+
+#include <QByteArray>
+#include <QSharedPointer>
+
+/*!
+    \class CalcSnapshot
+    \brief Immutable copy of the displayable state of a calc
+
+    Published by the emulation thread after every slice so that the GUI
+    can read the LCD without touching the emulator core or its lock.
+*/
+struct CalcSnapshot
+{
+    int width, height;
+
+    // whether the LCD shows anything at all, see Calc::lcdBits()
+    bool lcdOn;
+    int contrast;
+
+    bool halted;
+    quint64 cycles;
+
+    // 1 bit per pixel, MSB first, set bits are dark
+    QByteArray lcd;
+};
+
+typedef QSharedPointer<const CalcSnapshot> CalcSnapshotPtr;
+
+#endif // CALCSNAPSHOT_H
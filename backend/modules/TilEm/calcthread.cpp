@@ -1,6 +1,9 @@
 #include "calcthread.h"
+#include "calcpacer.h"
+#include "slicetuner.h"
 
 #include <QDebug>
+#include <QElapsedTimer>
 
 CalcThread::CalcThread(Calc *c, QObject * p)
     : QThread(p), m_calc(c), exiting(0)
@@ -18,25 +21,51 @@ void CalcThread::step()
 
 void CalcThread::stop()
 {
+    if ( !isRunning() )
+        return;
+
 //  top emulator thread before loading a new ROM
     exiting = 1;
 
+//  do not let it finish its nap first
+    m_calc->wakeUp();
+
 //  wait for thread to terminate
-    while ( isRunning() )
-        usleep(1000);
+    wait();
 }
 
 void CalcThread::run()
 {
     int res;
 
+    SliceTuner tuner;
+    CalcPacer pacer;
+    bool turbo = false;
+
+    // throughput measurement
+    QElapsedTimer window;
+    qint64 emulated = 0;
+
+    window.start();
+
     qDebug() << "CalcThread: " << "start running";
 
     emit runningChanged(true);
 
     forever
     {
-        if ( (res = (exiting ? m_calc->run_cc(1) : m_calc->run_us(10000))) )
+        if ( turbo != m_calc->isTurbo() )
+        {
+            turbo = m_calc->isTurbo();
+
+            // do not try to make up for time spent unthrottled
+            pacer.reset();
+        }
+
+        int amount = tuner.next(m_calc);
+        const bool idle = tuner.isIdle();
+
+        if ( (res = (exiting ? m_calc->run_cc(1) : m_calc->runSlice(amount, &amount))) )
         {
 //          if ( res & TILEM_STOP_BREAKPOINT )
 //          {
@@ -50,12 +79,41 @@ void CalcThread::run()
         if ( exiting )
             break;
 
-//      slightly slow down emulation (TODO : make delay adjustable)
-        usleep(10000);
+        emulated += amount;
+
+        if ( window.elapsed() >= 500 )
+        {
+            qint64 elapsed = window.nsecsElapsed() / 1000;
+
+            // emulated cycles per host microsecond
+            m_calc->setEmulatedMHz(qreal(emulated) * m_calc->clockSpeed() / 1000 / elapsed);
+            m_calc->updateSliceStats(tuner.current());
+
+            emulated = 0;
+            window.restart();
+        }
+
+        if ( turbo )
+            continue;
+
+//      only sleep for what is left of the slice in host time
+        pacer.setSpeed(m_calc->speed());
+        pacer.setCatchUpLimit(m_calc->catchUpLimit() * 1000);
+
+        qint64 wait = pacer.advance(amount);
+
+        // input (or stop()) cuts the nap short
+        if ( m_calc->waitForWakeUp(wait) && idle )
+        {
+            // forget the lead a long idle slice had on the host
+            pacer.reset();
+        }
     }
 
     exiting = 0;
 
+    m_calc->setEmulatedMHz(0);
+
     qDebug() << "CalcThread: " << "stop running";
 
     emit runningChanged(false);
@@ -0,0 +1,500 @@
+#include "emulatorpool.h"
+
+#include "calc.h"
+#include "calcpacer.h"
+#include "slicetuner.h"
+
+#include <QThread>
+#include <QDebug>
+
+/*!
+    \internal
+    \brief State of one pooled calc
+*/
+struct EmulatorPool::Job
+{
+    Job(Calc *c)
+     : calc(c), due(0), turbo(false), idle(false), removed(false), stopped(false), deferred(false), emulated(0)
+    {
+        window.start();
+    }
+
+    Calc *calc;
+    CalcPacer pacer;
+    SliceTuner tuner;
+
+    // pool clock time (us) at which the next slice may run
+    qint64 due;
+
+    bool turbo;
+
+    // the calc was idle during its last slice, see Calc::isIdle()
+    bool idle;
+
+    // removed : remove() was called, stopped : the emulator stopped by itself
+    volatile bool removed;
+    bool stopped;
+
+    // removed from a worker thread, finish() sends the notifications
+    bool deferred;
+
+    // throughput measurement
+    QElapsedTimer window;
+    qint64 emulated;
+};
+
+/*!
+    \internal
+    \class PoolWorker
+    \brief One of the threads of an EmulatorPool
+*/
+class PoolWorker : public QThread
+{
+    public:
+        PoolWorker(EmulatorPool *pool, int id)
+         : QThread(0), m_pool(pool), m_id(id)
+        {
+        }
+
+    protected:
+        virtual void run()
+        {
+            EmulatorPool::Job *job;
+
+            while ( (job = m_pool->next(m_id)) )
+            {
+                m_pool->runSlice(job);
+                m_pool->finish(m_id, job);
+            }
+        }
+
+    private:
+        EmulatorPool *m_pool;
+        int m_id;
+};
+
+Q_GLOBAL_STATIC(EmulatorPool, globalPool)
+
+/**
+ * @brief Tell a calc it is no longer emulated, same notifications as CalcThread
+ *
+ * Queued, as it may be called from a worker thread.
+ *
+ * @param c
+ */
+static void notify_stopped(Calc *c)
+{
+    c->setEmulatedMHz(0);
+
+    QMetaObject::invokeMethod(c, "paused", Qt::QueuedConnection);
+    QMetaObject::invokeMethod(c, "paused", Qt::QueuedConnection, Q_ARG(bool, false));
+}
+
+/**
+ * @brief Create a pool
+ *
+ * @param workers Number of worker threads, one per core if 0
+ * @param p
+ */
+EmulatorPool::EmulatorPool(int workers, QObject *p)
+ : QObject(p), m_idleCount(0), m_generation(0), m_quit(false)
+{
+    if ( workers <= 0 )
+        workers = qMax(1, QThread::idealThreadCount());
+
+    m_clock.start();
+
+    for ( int i = 0; i < workers; ++i )
+        m_queues << new Queue;
+
+    for ( int i = 0; i < workers; ++i )
+    {
+        PoolWorker *w = new PoolWorker(this, i);
+        m_workers << w;
+        w->start();
+    }
+}
+
+EmulatorPool::~EmulatorPool()
+{
+    QList<Calc*> calcs;
+
+    m_lock.lock();
+    foreach ( const Calc *c, m_jobs.keys() )
+        calcs << const_cast<Calc*>(c);
+    m_lock.unlock();
+
+    foreach ( Calc *c, calcs )
+        remove(c);
+
+    m_idleLock.lock();
+    m_quit = true;
+    m_idle.wakeAll();
+    m_idleLock.unlock();
+
+    foreach ( PoolWorker *w, m_workers )
+    {
+        w->wait();
+        delete w;
+    }
+
+    qDeleteAll(m_queues);
+}
+
+/**
+ * @brief Process wide pool, with one worker per core
+ *
+ * @return
+ */
+EmulatorPool* EmulatorPool::instance()
+{
+    return globalPool();
+}
+
+/**
+ * @brief Number of worker threads
+ *
+ * @return
+ */
+int EmulatorPool::workerCount() const
+{
+    return m_workers.count();
+}
+
+/**
+ * @brief Number of calcs currently being emulated by the pool
+ *
+ * @return
+ */
+int EmulatorPool::count() const
+{
+    QMutexLocker l(&m_lock);
+    return m_jobs.count();
+}
+
+/**
+ * @brief Whether a calc is currently being emulated by the pool
+ *
+ * @param c
+ *
+ * @return
+ */
+bool EmulatorPool::contains(const Calc *c) const
+{
+    QMutexLocker l(&m_lock);
+    return m_jobs.contains(c);
+}
+
+/**
+ * @brief Start emulating a calc
+ *
+ * @param c The calc, must outlive its membership in the pool
+ */
+void EmulatorPool::add(Calc *c)
+{
+    QMutexLocker l(&m_lock);
+
+    if ( !c->isValid() )
+        return;
+
+    if ( Job *job = m_jobs.value(c, 0) )
+    {
+        // re-added from a worker before its deferred removal went through
+        if ( job->deferred )
+            job->removed = job->deferred = false;
+
+        return;
+    }
+
+    Job *job = new Job(c);
+    job->due = m_clock.nsecsElapsed() / 1000;
+
+    m_jobs.insert(c, job);
+
+    // spread new jobs, stealing evens things out afterwards anyway
+    enqueue(m_jobs.count() % m_queues.count(), job);
+
+    l.unlock();
+
+    // same notifications as CalcThread
+    QMetaObject::invokeMethod(c, "resumed", Qt::QueuedConnection);
+    QMetaObject::invokeMethod(c, "paused", Qt::QueuedConnection, Q_ARG(bool, true));
+}
+
+/**
+ * @brief Stop emulating a calc
+ *
+ * Blocks until the slice currently being run for this calc, if any, is done.
+ * From a worker thread (e.g. a breakpoint handler) that slice may be the
+ * caller itself, or another worker may be waiting on the caller's own
+ * calc : the calc is then retired by finish() once its slice is over.
+ *
+ * @param c
+ */
+void EmulatorPool::remove(Calc *c)
+{
+    QMutexLocker l(&m_lock);
+
+    Job *job = m_jobs.value(c, 0);
+
+    if ( !job )
+        return;
+
+    job->removed = true;
+
+    if ( unqueue(job) )
+    {
+        m_jobs.remove(c);
+        delete job;
+    } else if ( isWorker() ) {
+        job->deferred = true;
+        return;
+    } else {
+        // a worker is running it, finish() retires it
+        while ( m_jobs.contains(c) )
+            m_retired.wait(&m_lock);
+    }
+
+    l.unlock();
+
+    notify_stopped(c);
+}
+
+/**
+ * @brief Pick the next job for a worker, blocks until one is due
+ *
+ * @param worker
+ *
+ * @return the job, 0 when the pool is shutting down
+ */
+EmulatorPool::Job* EmulatorPool::next(int worker)
+{
+    const int n = m_queues.count();
+
+    forever
+    {
+        m_idleLock.lock();
+        const quint64 generation = m_generation;
+        const bool quit = m_quit;
+        m_idleLock.unlock();
+
+        if ( quit )
+            return 0;
+
+        const qint64 now = m_clock.nsecsElapsed() / 1000;
+        qint64 wake = -1;
+
+        for ( int k = 0; k < n; ++k )
+        {
+            Queue *q = m_queues.at((worker + k) % n);
+
+            QMutexLocker l(&q->lock);
+
+            const int count = q->jobs.count();
+
+            for ( int j = 0; j < count; ++j )
+            {
+                // serve our own queue from the front, steal from the back of others
+                const int idx = k ? count - 1 - j : j;
+                Job *job = q->jobs.at(idx);
+
+                if ( job->due <= now )
+                {
+                    q->jobs.removeAt(idx);
+                    return job;
+                }
+
+                if ( wake < 0 || job->due < wake )
+                    wake = job->due;
+            }
+        }
+
+        // nothing due : sleep until something is or new work comes in
+        QMutexLocker l(&m_idleLock);
+
+        if ( generation != m_generation || m_quit )
+            continue;
+
+        ++m_idleCount;
+
+        if ( wake < 0 )
+            m_idle.wait(&m_idleLock);
+        else
+            m_idle.wait(&m_idleLock, qMax(qint64(1), (wake - now + 999) / 1000));
+
+        --m_idleCount;
+    }
+}
+
+/**
+ * @brief Hand back a job after a worker ran a slice of it
+ *
+ * @param worker
+ * @param job
+ */
+void EmulatorPool::finish(int worker, Job *job)
+{
+    QMutexLocker l(&m_lock);
+
+    if ( !job->removed && !job->stopped )
+    {
+        enqueue(worker, job);
+        return;
+    }
+
+    Calc *c = job->calc;
+    bool notify = !job->removed || job->deferred;
+
+    m_jobs.remove(c);
+    delete job;
+
+    m_retired.wakeAll();
+
+    l.unlock();
+
+    if ( notify )
+        notify_stopped(c);
+}
+
+void EmulatorPool::enqueue(int worker, Job *job)
+{
+    Queue *q = m_queues.at(worker);
+
+    q->lock.lock();
+    q->jobs.append(job);
+    q->lock.unlock();
+
+    QMutexLocker l(&m_idleLock);
+
+    ++m_generation;
+
+    if ( m_idleCount )
+        m_idle.wakeOne();
+}
+
+/**
+ * @brief Make an idle calc due right away, because input is pending
+ *
+ * @param c
+ */
+void EmulatorPool::wake(Calc *c)
+{
+    QMutexLocker l(&m_lock);
+
+    Job *job = m_jobs.value(c, 0);
+
+    if ( !job )
+        return;
+
+    bool queued = false;
+
+    foreach ( Queue *q, m_queues )
+    {
+        QMutexLocker ql(&q->lock);
+
+        if ( q->jobs.contains(job) )
+        {
+            queued = true;
+
+            if ( job->idle )
+            {
+                job->due = m_clock.nsecsElapsed() / 1000;
+                job->pacer.reset();
+            }
+            break;
+        }
+    }
+
+    // a running job picks the input up in its next slice anyway
+    if ( !queued || !job->idle )
+        return;
+
+    QMutexLocker il(&m_idleLock);
+
+    ++m_generation;
+
+    if ( m_idleCount )
+        m_idle.wakeOne();
+}
+
+/**
+ * @brief Whether the calling thread is one of the workers
+ *
+ * @return
+ */
+bool EmulatorPool::isWorker() const
+{
+    QThread *t = QThread::currentThread();
+
+    foreach ( PoolWorker *w, m_workers )
+        if ( w == t )
+            return true;
+
+    return false;
+}
+
+bool EmulatorPool::unqueue(Job *job)
+{
+    foreach ( Queue *q, m_queues )
+    {
+        QMutexLocker l(&q->lock);
+
+        if ( q->jobs.removeOne(job) )
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Run one slice of emulated time for a job, from a worker thread
+ *
+ * @param job
+ */
+void EmulatorPool::runSlice(Job *job)
+{
+    Calc *c = job->calc;
+
+    if ( job->turbo != c->isTurbo() )
+    {
+        job->turbo = c->isTurbo();
+        job->pacer.reset();
+    }
+
+    int amount = job->tuner.next(c);
+
+    job->idle = job->tuner.isIdle();
+
+    // breakpoint or link error : stop, as CalcThread does
+    if ( c->runSlice(amount, &amount) )
+    {
+        job->stopped = true;
+        return;
+    }
+
+    job->emulated += amount;
+
+    if ( job->window.elapsed() >= 500 )
+    {
+        qint64 elapsed = job->window.nsecsElapsed() / 1000;
+
+        c->setEmulatedMHz(qreal(job->emulated) * c->clockSpeed() / 1000 / elapsed);
+        c->updateSliceStats(job->tuner.current());
+
+        job->emulated = 0;
+        job->window.restart();
+    }
+
+    const qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    if ( job->turbo )
+    {
+        job->due = now;
+        return;
+    }
+
+    job->pacer.setSpeed(c->speed());
+    job->pacer.setCatchUpLimit(c->catchUpLimit() * 1000);
+
+    job->due = now + job->pacer.advance(amount);
+}
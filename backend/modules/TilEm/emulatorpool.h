@@ -0,0 +1,86 @@
+#ifndef EMULATORPOOL_H
+#define EMULATORPOOL_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+
+class Calc;
+class PoolWorker;
+
+/*!
+    \class EmulatorPool
+    \brief Runs many calcs on a fixed set of worker threads
+
+    Instead of one CalcThread (and one OS thread) per Calc, every pooled
+    calc is a job that runs one slice of emulated time at a time. Each
+    worker owns a FIFO queue of jobs: it serves its own queue from the
+    front and steals from the back of the other queues when it runs out
+    of work, so the load spreads over all cores. A job that ran a slice
+    goes back to the end of a queue, which gives every instance the same
+    share of emulated time. Throttled jobs carry the host time at which
+    they are due again (see CalcPacer) so idle workers sleep instead of
+    spinning. Halted calcs run long slices and are woken up early by
+    input (see wake()).
+*/
+class EmulatorPool : public QObject
+{
+    friend class PoolWorker;
+
+    Q_OBJECT
+
+    public:
+        EmulatorPool(int workers = 0, QObject *p = 0);
+        ~EmulatorPool();
+
+        static EmulatorPool* instance();
+
+        int workerCount() const;
+        int count() const;
+
+        bool contains(const Calc *c) const;
+
+        void add(Calc *c);
+        void remove(Calc *c);
+
+        void wake(Calc *c);
+
+    private:
+        struct Job;
+
+        struct Queue
+        {
+            QMutex lock;
+            QList<Job*> jobs;
+        };
+
+        Job* next(int worker);
+        void finish(int worker, Job *job);
+
+        void enqueue(int worker, Job *job);
+        bool unqueue(Job *job);
+
+        bool isWorker() const;
+
+        void runSlice(Job *job);
+
+        QElapsedTimer m_clock;
+
+        mutable QMutex m_lock;
+        QWaitCondition m_retired;
+        QHash<const Calc*, Job*> m_jobs;
+
+        QList<Queue*> m_queues;
+        QList<PoolWorker*> m_workers;
+
+        QMutex m_idleLock;
+        QWaitCondition m_idle;
+        int m_idleCount;
+        quint64 m_generation;
+        volatile bool m_quit;
+};
+
+#endif // EMULATORPOOL_H
@@ -0,0 +1,550 @@
+#include "framerecorder.h"
+
+#include <QThread>
+#include <QImage>
+#include <QFile>
+#include <QDebug>
+
+#include <string.h>
+
+/*
+    GIF writing : header and global palette, then one image per frame
+    (graphic control extension + descriptor + LZW data), see the GIF89a
+    specification.
+*/
+
+static void put_word(QByteArray& d, int v)
+{
+    d += char(v & 0xff);
+    d += char((v >> 8) & 0xff);
+}
+
+/*
+    Variable length LZW codes, packed LSB first into sub-blocks of at most
+    255 bytes.
+*/
+class LzwWriter
+{
+    public:
+        LzwWriter(QByteArray& out)
+         : m_out(out), m_bits(0), m_count(0)
+        {
+        }
+
+        void write(int code, int size)
+        {
+            m_bits |= quint32(code) << m_count;
+            m_count += size;
+
+            while ( m_count >= 8 )
+            {
+                byte(m_bits & 0xff);
+                m_bits >>= 8;
+                m_count -= 8;
+            }
+        }
+
+        void flush()
+        {
+            if ( m_count )
+                byte(m_bits & 0xff);
+
+            if ( m_block.size() )
+                block();
+
+            // block terminator
+            m_out += char(0);
+        }
+
+    private:
+        void byte(int b)
+        {
+            m_block += char(b);
+
+            if ( m_block.size() == 255 )
+                block();
+        }
+
+        void block()
+        {
+            m_out += char(m_block.size());
+            m_out += m_block;
+            m_block.clear();
+        }
+
+        QByteArray& m_out;
+        QByteArray m_block;
+        quint32 m_bits;
+        int m_count;
+};
+
+/*
+    8 bit GIF LZW : codes start at 9 bits and grow to 12, the table is
+    cleared once it is full. Strings are looked up in an open addressing
+    hash of (prefix, byte) pairs.
+*/
+static void lzw_encode(QByteArray& out, const unsigned char *pix, int count)
+{
+    enum
+    {
+        ClearCode = 256,
+        EndCode = 257,
+        FirstCode = 258,
+        MaxCode = 4095,
+        HashSize = 5003
+    };
+
+    QVector<int> keys(HashSize), codes(HashSize);
+    LzwWriter w(out);
+
+    int next = FirstCode, size = 9;
+
+    keys.fill(-1);
+
+    out += char(8);
+    w.write(ClearCode, size);
+
+    if ( !count )
+    {
+        w.write(EndCode, size);
+        w.flush();
+        return;
+    }
+
+    int prefix = pix[0];
+
+    for ( int i = 1; i < count; ++i )
+    {
+        const int key = (prefix << 8) | pix[i];
+        int h = key % HashSize;
+
+        while ( keys[h] != -1 && keys[h] != key )
+            h = (h + 1) % HashSize;
+
+        if ( keys[h] == key )
+        {
+            prefix = codes[h];
+            continue;
+        }
+
+        w.write(prefix, size);
+
+        // the decoder widens its codes one code later than the table grows
+        if ( next >= (1 << size) && size < 12 )
+            ++size;
+
+        if ( next < MaxCode )
+        {
+            keys[h] = key;
+            codes[h] = next++;
+        } else {
+            w.write(ClearCode, size);
+            keys.fill(-1);
+            next = FirstCode;
+            size = 9;
+        }
+
+        prefix = pix[i];
+    }
+
+    w.write(prefix, size);
+
+    if ( next >= (1 << size) && size < 12 )
+        ++size;
+
+    w.write(EndCode, size);
+    w.flush();
+}
+
+/*!
+    \internal
+    \class GifWriter
+    \brief Animated GIF made of the differences between frames
+*/
+class GifWriter
+{
+    public:
+        bool open(const QString& file, int width, int height, const QVector<QRgb>& palette)
+        {
+            m_file.setFileName(file);
+
+            if ( !m_file.open(QFile::WriteOnly) )
+                return false;
+
+            m_width = width;
+            m_height = height;
+            m_canvas.clear();
+            m_pending.clear();
+
+            QByteArray d("GIF89a");
+
+            put_word(d, width);
+            put_word(d, height);
+
+            // global palette of 256 colours, background 0, square pixels
+            d += char(0xf7);
+            d += char(0);
+            d += char(0);
+
+            for ( int i = 0; i < 256; ++i )
+            {
+                const QRgb c = i < palette.count() ? palette.at(i) : 0;
+
+                d += char(qRed(c));
+                d += char(qGreen(c));
+                d += char(qBlue(c));
+            }
+
+            // loop forever
+            d += QByteArray("\x21\xff\x0b" "NETSCAPE2.0" "\x03\x01\x00\x00\x00", 19);
+
+            return m_file.write(d) == d.size();
+        }
+
+        bool frame(const QByteArray& gray, qint64 time)
+        {
+            if ( !m_pending.isEmpty() )
+            {
+                // unchanged : the pending frame just lasts longer
+                if ( gray == m_pending )
+                    return true;
+
+                // too close to the pending one : replace it, intermediate frames would not show anyway
+                if ( time - m_pendingTime < FrameRecorder::MinDelay )
+                {
+                    m_pending = gray;
+                    return true;
+                }
+
+                if ( !writePending(time) )
+                    return false;
+            }
+
+            m_pending = gray;
+            m_pendingTime = time;
+
+            return true;
+        }
+
+        bool close(qint64 time)
+        {
+            bool ok = m_pending.isEmpty() || writePending(qMax(time, m_pendingTime + FrameRecorder::MinDelay));
+
+            ok = m_file.putChar(0x3b) && ok;
+            m_file.close();
+
+            return ok;
+        }
+
+    private:
+        bool writePending(qint64 end)
+        {
+            const unsigned char *p = reinterpret_cast<const unsigned char*>(m_pending.constData());
+            const unsigned char *c = reinterpret_cast<const unsigned char*>(m_canvas.constData());
+
+            // bounding box of the pixels that differ from what is shown
+            int x0 = 0, y0 = 0, x1 = m_width - 1, y1 = m_height - 1;
+
+            if ( !m_canvas.isEmpty() )
+            {
+                x0 = m_width; y0 = m_height; x1 = -1; y1 = -1;
+
+                for ( int y = 0; y < m_height; ++y )
+                {
+                    for ( int x = 0; x < m_width; ++x )
+                    {
+                        if ( p[y * m_width + x] != c[y * m_width + x] )
+                        {
+                            x0 = qMin(x0, x);
+                            x1 = qMax(x1, x);
+                            y0 = qMin(y0, y);
+                            y1 = qMax(y1, y);
+                        }
+                    }
+                }
+
+                // back to what was shown : a 1 pixel frame still carries the delay
+                if ( x1 < 0 )
+                    x0 = x1 = y0 = y1 = 0;
+            }
+
+            const int w = x1 - x0 + 1, h = y1 - y0 + 1;
+
+            QByteArray d;
+
+            // graphic control extension : leave the frame in place, delay in 1/100 s
+            d += QByteArray("\x21\xf9\x04\x04", 4);
+            put_word(d, int(qMax(qint64(2), (end - m_pendingTime + 5) / 10)));
+            d += char(0);
+            d += char(0);
+
+            // image descriptor, no local palette
+            d += char(0x2c);
+            put_word(d, x0);
+            put_word(d, y0);
+            put_word(d, w);
+            put_word(d, h);
+            d += char(0);
+
+            QByteArray rect(w * h, 0);
+
+            for ( int y = 0; y < h; ++y )
+                memcpy(rect.data() + y * w, p + (y0 + y) * m_width + x0, w);
+
+            lzw_encode(d, reinterpret_cast<const unsigned char*>(rect.constData()), rect.size());
+
+            m_canvas = m_pending;
+
+            return m_file.write(d) == d.size();
+        }
+
+        QFile m_file;
+        int m_width, m_height;
+
+        // what a viewer shows after the frames written so far, and the frame not written yet
+        QByteArray m_canvas, m_pending;
+        qint64 m_pendingTime;
+};
+
+/*!
+    \internal
+    \class RecorderThread
+    \brief Encodes and writes the jobs of a FrameRecorder
+*/
+class RecorderThread : public QThread
+{
+    public:
+        RecorderThread(FrameRecorder *r)
+         : QThread(0), m_recorder(r)
+        {
+        }
+
+    protected:
+        virtual void run()
+        {
+            FrameRecorder::Job job;
+            GifWriter gif;
+            QString capture;
+            bool ok = false;
+
+            while ( m_recorder->take(job) )
+            {
+                switch ( job.type )
+                {
+                    case FrameRecorder::Job::Screenshot:
+                        if ( screenshot(job) )
+                            emit m_recorder->saved(job.file);
+                        else
+                            emit m_recorder->failed(job.file);
+                        break;
+
+                    case FrameRecorder::Job::Start:
+                        capture = job.file;
+                        ok = gif.open(job.file, job.width, job.height, job.palette);
+                        break;
+
+                    case FrameRecorder::Job::Frame:
+                        ok = ok && gif.frame(job.gray, job.time);
+                        break;
+
+                    case FrameRecorder::Job::Stop:
+                        ok = gif.close(job.time) && ok;
+
+                        if ( ok )
+                            emit m_recorder->saved(capture);
+                        else
+                            emit m_recorder->failed(capture);
+                        break;
+                }
+            }
+        }
+
+    private:
+        static bool screenshot(const FrameRecorder::Job& job)
+        {
+            QImage img(job.width, job.height, QImage::Format_Indexed8);
+
+            img.setColorTable(job.palette);
+
+            for ( int y = 0; y < job.height; ++y )
+                memcpy(img.scanLine(y), job.gray.constData() + y * job.width, job.width);
+
+            return img.save(job.file, "PNG");
+        }
+
+        FrameRecorder *m_recorder;
+};
+
+FrameRecorder::FrameRecorder(QObject *p)
+ : QObject(p), m_quit(false), m_capturing(false), m_width(0), m_height(0), m_dropped(0)
+{
+    m_thread = new RecorderThread(this);
+    m_thread->start(QThread::LowPriority);
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    stop();
+
+    m_lock.lock();
+    m_quit = true;
+    m_cond.wakeAll();
+    m_lock.unlock();
+
+    // pending jobs are still written
+    m_thread->wait();
+    delete m_thread;
+}
+
+bool FrameRecorder::isCapturing() const
+{
+    return m_capturing;
+}
+
+/**
+ * @brief Number of frames dropped because the encoder could not keep up, since the last start()
+ *
+ * @return
+ */
+int FrameRecorder::droppedFrames() const
+{
+    return m_dropped;
+}
+
+/**
+ * @brief Save one frame as a PNG image, in the background
+ *
+ * @param file
+ * @param gray width * height intensities
+ * @param width
+ * @param height
+ * @param palette Colour of each intensity
+ *
+ * @return false if the queue was full
+ */
+bool FrameRecorder::screenshot(const QString& file, const unsigned char *gray, int width, int height, const QVector<QRgb>& palette)
+{
+    Job job;
+    job.type = Job::Screenshot;
+    job.file = file;
+    job.width = width;
+    job.height = height;
+    job.palette = palette;
+    job.gray = QByteArray(reinterpret_cast<const char*>(gray), width * height);
+    job.time = 0;
+
+    return post(job, true);
+}
+
+/**
+ * @brief Start an animated capture, frames are then given to addFrame()
+ *
+ * @param file GIF file to write
+ * @param width
+ * @param height
+ * @param palette Colour of each intensity, for the whole capture
+ *
+ * @return
+ */
+bool FrameRecorder::start(const QString& file, int width, int height, const QVector<QRgb>& palette)
+{
+    stop();
+
+    Job job;
+    job.type = Job::Start;
+    job.file = file;
+    job.width = width;
+    job.height = height;
+    job.palette = palette;
+    job.time = 0;
+
+    m_width = width;
+    m_height = height;
+    m_dropped = 0;
+    m_clock.start();
+
+    // never dropped, it would take the whole capture with it
+    m_capturing = post(job, false);
+
+    return m_capturing;
+}
+
+/**
+ * @brief Add a frame to the capture, time stamped now
+ *
+ * @param gray width * height intensities
+ * @param width
+ * @param height
+ *
+ * @return false if the frame does not have the size given to start(), it is then left out
+ */
+bool FrameRecorder::addFrame(const unsigned char *gray, int width, int height)
+{
+    if ( !m_capturing )
+        return true;
+
+    if ( width != m_width || height != m_height )
+        return false;
+
+    Job job;
+    job.type = Job::Frame;
+    job.width = m_width;
+    job.height = m_height;
+    job.gray = QByteArray(reinterpret_cast<const char*>(gray), m_width * m_height);
+    job.time = m_clock.elapsed();
+
+    if ( !post(job, true) )
+        ++m_dropped;
+
+    return true;
+}
+
+/**
+ * @brief Finish the capture, the file is complete once saved() is emitted
+ */
+void FrameRecorder::stop()
+{
+    if ( !m_capturing )
+        return;
+
+    Job job;
+    job.type = Job::Stop;
+    job.width = m_width;
+    job.height = m_height;
+    job.time = m_clock.elapsed();
+
+    post(job, false);
+
+    m_capturing = false;
+
+    if ( m_dropped )
+        qWarning("FrameRecorder: %i frames dropped", m_dropped);
+}
+
+bool FrameRecorder::post(const Job& job, bool drop)
+{
+    QMutexLocker l(&m_lock);
+
+    if ( drop && m_queue.count() >= QueueSize )
+        return false;
+
+    m_queue << job;
+    m_cond.wakeOne();
+
+    return true;
+}
+
+bool FrameRecorder::take(Job& job)
+{
+    QMutexLocker l(&m_lock);
+
+    while ( m_queue.isEmpty() && !m_quit )
+        m_cond.wait(&m_lock);
+
+    if ( m_queue.isEmpty() )
+        return false;
+
+    job = m_queue.takeFirst();
+
+    return true;
+}
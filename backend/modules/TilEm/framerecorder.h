@@ -0,0 +1,96 @@
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include <QObject>
+#include <QList>
+#include <QVector>
+#include <QColor>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+
+class RecorderThread;
+
+/*!
+    \class FrameRecorder
+    \brief Screenshots and animated captures of the calc LCD
+
+    Frames are native resolution LCD intensities (see Calc::lcdGray()),
+    which double as palette indices : 0 is lcdBlack, 255 lcdWhite. They are
+    copied into a bounded queue and encoded by a background thread, so the
+    caller never waits for the disk or the encoder. When the queue is full
+    frames are dropped rather than stalling the GUI or the emulation.
+
+    Screenshots are saved as PNG. Captures are written as animated GIF :
+    one global palette, each frame only stores the rectangle that changed
+    since the previous one, and frames closer than MinDelay ms are merged.
+*/
+class FrameRecorder : public QObject
+{
+    friend class RecorderThread;
+
+    Q_OBJECT
+
+    public:
+        enum
+        {
+            QueueSize = 32,
+
+            // GIF delays are in 1/100 s and most viewers clamp anything below 2
+            MinDelay = 20
+        };
+
+        FrameRecorder(QObject *p = 0);
+        ~FrameRecorder();
+
+        bool isCapturing() const;
+        int droppedFrames() const;
+
+        bool screenshot(const QString& file, const unsigned char *gray, int width, int height, const QVector<QRgb>& palette);
+
+        bool start(const QString& file, int width, int height, const QVector<QRgb>& palette);
+        bool addFrame(const unsigned char *gray, int width, int height);
+        void stop();
+
+    Q_SIGNALS:
+        void saved(const QString& file);
+        void failed(const QString& file);
+
+    private:
+        struct Job
+        {
+            enum Type
+            {
+                Screenshot,
+                Start,
+                Frame,
+                Stop
+            };
+
+            Type type;
+            QString file;
+            int width, height;
+            QVector<QRgb> palette;
+            QByteArray gray;
+
+            // ms since start()
+            qint64 time;
+        };
+
+        bool post(const Job& job, bool drop);
+        bool take(Job& job);
+
+        RecorderThread *m_thread;
+
+        QMutex m_lock;
+        QWaitCondition m_cond;
+        QList<Job> m_queue;
+        bool m_quit;
+
+        // GUI side state of the capture
+        bool m_capturing;
+        int m_width, m_height, m_dropped;
+        QElapsedTimer m_clock;
+};
+
+#endif // FRAMERECORDER_H
@@ -0,0 +1,250 @@
+#include "inputlog.h"
+
+#include <QFile>
+#include <QDebug>
+
+static const char log_magic[] = "TILG";
+static const int log_version = 1;
+
+static void put_varint(QByteArray& d, quint64 v)
+{
+    while ( v >= 0x80 )
+    {
+        d += char((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+
+    d += char(v);
+}
+
+static bool get_varint(const QByteArray& d, int& pos, quint64& v)
+{
+    v = 0;
+
+    for ( int shift = 0; pos < d.size() && shift < 64; shift += 7 )
+    {
+        unsigned char c = d.at(pos++);
+
+        v |= quint64(c & 0x7f) << shift;
+
+        if ( !(c & 0x80) )
+            return true;
+    }
+
+    return false;
+}
+
+InputLog::InputLog()
+ : m_sliceCycles(0)
+{
+}
+
+void InputLog::clear()
+{
+    m_events.clear();
+}
+
+bool InputLog::isEmpty() const
+{
+    return m_events.isEmpty();
+}
+
+int InputLog::count() const
+{
+    return m_events.count();
+}
+
+const InputLog::Event& InputLog::at(int i) const
+{
+    return m_events.at(i);
+}
+
+/**
+ * @brief Record an event
+ *
+ * @param cycle Emulated cycle at which the event was applied, never lower than the previous one
+ * @param type
+ * @param key Scancode for key events
+ * @param data Bytes for link events
+ */
+void InputLog::append(quint64 cycle, Type type, int key, const QByteArray& data)
+{
+    Event e;
+    e.cycle = cycle;
+    e.type = type;
+    e.key = key;
+    e.data = data;
+
+    m_events << e;
+}
+
+/**
+ * @brief Length of the emulation slices, in clock cycles, inputs are only applied between slices
+ *
+ * @return
+ */
+int InputLog::sliceCycles() const
+{
+    return m_sliceCycles;
+}
+
+void InputLog::setSliceCycles(int cycles)
+{
+    m_sliceCycles = cycles;
+}
+
+/**
+ * @brief ROM the recording was made with, used when no ROM was saved next to the log
+ *
+ * @return
+ */
+QString InputLog::romFile() const
+{
+    return m_romFile;
+}
+
+void InputLog::setRomFile(const QString& file)
+{
+    m_romFile = file;
+}
+
+bool InputLog::save(const QString& file) const
+{
+    QByteArray d(log_magic, 4);
+
+    put_varint(d, log_version);
+    put_varint(d, m_sliceCycles);
+
+    QByteArray rom = m_romFile.toUtf8();
+    put_varint(d, rom.size());
+    d += rom;
+
+    put_varint(d, m_events.count());
+
+    quint64 last = 0;
+
+    foreach ( const Event& e, m_events )
+    {
+        put_varint(d, e.cycle - last);
+        d += char(e.type);
+
+        switch ( e.type )
+        {
+            case KeyPress:
+            case KeyRelease:
+                d += char(e.key);
+                break;
+
+            case LinkBytes:
+                put_varint(d, e.data.size());
+                d += e.data;
+                break;
+
+            default:
+                break;
+        }
+
+        last = e.cycle;
+    }
+
+    QFile f(file);
+
+    if ( !f.open(QFile::WriteOnly) || f.write(d) != d.size() )
+    {
+        qWarning("Unable to write input log \"%s\"", qPrintable(file));
+        return false;
+    }
+
+    return true;
+}
+
+bool InputLog::load(const QString& file)
+{
+    QFile f(file);
+
+    if ( !f.open(QFile::ReadOnly) )
+    {
+        qWarning("Unable to read input log \"%s\"", qPrintable(file));
+        return false;
+    }
+
+    const QByteArray d = f.readAll();
+
+    int pos = 4;
+    quint64 version, slice, size, count, delta, len;
+
+    if (
+            !d.startsWith(log_magic)
+        ||
+            !get_varint(d, pos, version) || version != quint64(log_version)
+        ||
+            !get_varint(d, pos, slice)
+        ||
+            !get_varint(d, pos, size) || pos + size > quint64(d.size())
+        )
+    {
+        qWarning("Invalid input log \"%s\"", qPrintable(file));
+        return false;
+    }
+
+    m_sliceCycles = int(slice);
+    m_romFile = QString::fromUtf8(d.mid(pos, int(size)));
+    pos += int(size);
+
+    m_events.clear();
+
+    quint64 cycle = 0;
+    bool ok = get_varint(d, pos, count);
+
+    for ( quint64 i = 0; ok && i < count; ++i )
+    {
+        ok = get_varint(d, pos, delta) && pos < d.size();
+
+        if ( !ok )
+            break;
+
+        Event e;
+        e.cycle = (cycle += delta);
+        e.type = Type(d.at(pos++));
+        e.key = 0;
+
+        switch ( e.type )
+        {
+            case KeyPress:
+            case KeyRelease:
+                ok = pos < d.size();
+
+                if ( ok )
+                    e.key = (unsigned char) d.at(pos++);
+                break;
+
+            case LinkBytes:
+                ok = get_varint(d, pos, len) && pos + len <= quint64(d.size());
+
+                if ( ok )
+                {
+                    e.data = d.mid(pos, int(len));
+                    pos += int(len);
+                }
+                break;
+
+            case Reset:
+                break;
+
+            default:
+                ok = false;
+                break;
+        }
+
+        if ( ok )
+            m_events << e;
+    }
+
+    if ( !ok )
+    {
+        qWarning("Truncated input log \"%s\"", qPrintable(file));
+        m_events.clear();
+    }
+
+    return ok;
+}
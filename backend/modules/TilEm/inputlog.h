@@ -0,0 +1,65 @@
+#ifndef INPUTLOG_H
+#define INPUTLOG_H
+
+#include <QList>
+#include <QString>
+#include <QByteArray>
+
+/*!
+    \class InputLog
+    \brief Record of the inputs fed to a calc running in lockstep mode
+
+    Every event is stamped with the emulated clock cycle (counted from the
+    start of the recording) at which it was applied. Replaying the events
+    at the same cycles from the same initial state gives the same emulation,
+    bit for bit.
+
+    On disk the log is a small header followed by the events, each one
+    stored as a variable length delta from the previous cycle stamp, so
+    long idle stretches cost nothing.
+*/
+class InputLog
+{
+    public:
+        enum Type
+        {
+            KeyPress,
+            KeyRelease,
+            LinkBytes,
+            Reset
+        };
+
+        struct Event
+        {
+            quint64 cycle;
+            Type type;
+            int key;
+            QByteArray data;
+        };
+
+        InputLog();
+
+        void clear();
+
+        bool isEmpty() const;
+        int count() const;
+        const Event& at(int i) const;
+
+        void append(quint64 cycle, Type type, int key = 0, const QByteArray& data = QByteArray());
+
+        int sliceCycles() const;
+        void setSliceCycles(int cycles);
+
+        QString romFile() const;
+        void setRomFile(const QString& file);
+
+        bool save(const QString& file) const;
+        bool load(const QString& file);
+
+    private:
+        int m_sliceCycles;
+        QString m_romFile;
+        QList<Event> m_events;
+};
+
+#endif // INPUTLOG_H
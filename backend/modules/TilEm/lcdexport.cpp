@@ -0,0 +1,393 @@
+#include "lcdexport.h"
+
+#include <QDebug>
+
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define LCD_EXPORT_SHM
+#endif
+
+static const char export_magic[8] = { 'T', 'I', 'L', 'E', 'M', 'L', 'C', 'D' };
+
+static const LcdExportHeader* export_header(const unsigned char *map)
+{
+    return reinterpret_cast<const LcdExportHeader*>(map);
+}
+
+LcdExport::LcdExport()
+ : m_map(0), m_size(0)
+{
+}
+
+LcdExport::~LcdExport()
+{
+    close();
+}
+
+/**
+ * @brief POSIX name of the shared memory object : a leading slash and no other
+ *
+ * @param name
+ *
+ * @return
+ */
+QByteArray LcdExport::shmName(const QString& name)
+{
+    QString n = name;
+
+    n.replace('/', '_');
+
+    return ('/' + n).toLocal8Bit();
+}
+
+/**
+ * @brief Bytes taken by one slot, rounded to a cache line
+ *
+ * @param width
+ * @param height
+ *
+ * @return
+ */
+int LcdExport::slotSize(int width, int height)
+{
+    return (int(sizeof(LcdExportSlot)) + width * height + 63) & ~63;
+}
+
+/**
+ * @brief Create the shared memory object and start with no frame
+ *
+ * Fails if the object already exists : it belongs to another export (or
+ * was left behind by one that crashed), mapping it would mix up frames
+ * or hand memory someone else created to its readers.
+ *
+ * @param name Object name, see shmName()
+ * @param width LCD width
+ * @param height LCD height
+ *
+ * @return
+ */
+bool LcdExport::create(const QString& name, int width, int height)
+{
+    close();
+
+#ifdef LCD_EXPORT_SHM
+    const QByteArray shm = shmName(name);
+    const size_t size = HeaderSize + size_t(SlotCount) * slotSize(width, height);
+
+    int fd = shm_open(shm.constData(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if ( fd < 0 && errno == EEXIST )
+    {
+        qWarning("Shared memory \"%s\" already exists, remove it or pick another name", shm.constData());
+        return false;
+    }
+
+    if ( fd < 0 )
+    {
+        qWarning("Unable to create shared memory \"%s\" : %s", shm.constData(), strerror(errno));
+        return false;
+    }
+
+    void *map = MAP_FAILED;
+
+    if ( !ftruncate(fd, size) )
+        map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if ( map == MAP_FAILED )
+    {
+        qWarning("Unable to map shared memory \"%s\" : %s", shm.constData(), strerror(errno));
+        shm_unlink(shm.constData());
+        return false;
+    }
+
+    m_map = static_cast<unsigned char*>(map);
+    m_size = size;
+    m_name = name;
+
+    memset(m_map, 0, size);
+
+    LcdExportHeader *h = reinterpret_cast<LcdExportHeader*>(m_map);
+
+    h->version = Version;
+    h->width = width;
+    h->height = height;
+    h->slotCount = SlotCount;
+    h->slotSize = slotSize(width, height);
+
+    // readers check the magic last
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h->magic, export_magic, sizeof(export_magic));
+
+    return true;
+#else
+    Q_UNUSED(width)
+    Q_UNUSED(height)
+
+    qWarning("Shared memory LCD export \"%s\" is not supported on this platform", qPrintable(name));
+    return false;
+#endif
+}
+
+/**
+ * @brief Unmap and remove the object, readers keep their mapping until they close it
+ */
+void LcdExport::close()
+{
+#ifdef LCD_EXPORT_SHM
+    if ( m_map )
+    {
+        munmap(m_map, m_size);
+        shm_unlink(shmName(m_name).constData());
+    }
+#endif
+
+    m_map = 0;
+    m_size = 0;
+    m_name.clear();
+}
+
+bool LcdExport::isOpen() const
+{
+    return m_map;
+}
+
+QString LcdExport::name() const
+{
+    return m_name;
+}
+
+/**
+ * @brief Write a frame into the next slot, never waits for readers
+ *
+ * @param gray width * height intensities
+ * @param sequence Frame sequence number, increasing
+ * @param cycles
+ */
+void LcdExport::publish(const QByteArray& gray, quint64 sequence, quint64 cycles)
+{
+    if ( !m_map )
+        return;
+
+    LcdExportHeader *h = reinterpret_cast<LcdExportHeader*>(m_map);
+    LcdExportSlot *s = reinterpret_cast<LcdExportSlot*>(m_map + HeaderSize + (sequence % h->slotCount) * h->slotSize);
+
+    const int bytes = qMin(gray.size(), int(h->width * h->height));
+
+    // seqlock : odd, then data, then even again
+    s->lock.store(s->lock.load() + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s->sequence = sequence;
+    s->cycles = cycles;
+    memcpy(s + 1, gray.constData(), bytes);
+
+    s->lock.storeRelease(s->lock.load() + 1);
+
+    h->latest.storeRelease(sequence);
+}
+
+LcdExportReader::LcdExportReader()
+ : m_map(0), m_size(0)
+{
+}
+
+LcdExportReader::~LcdExportReader()
+{
+    close();
+}
+
+/**
+ * @brief Map an object created by LcdExport::create(), read only
+ *
+ * @param name
+ *
+ * @return
+ */
+bool LcdExportReader::open(const QString& name)
+{
+    close();
+
+#ifdef LCD_EXPORT_SHM
+    const QByteArray shm = LcdExport::shmName(name);
+
+    int fd = shm_open(shm.constData(), O_RDONLY, 0);
+
+    if ( fd < 0 )
+        return false;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if ( !fstat(fd, &st) && size_t(st.st_size) >= size_t(LcdExport::HeaderSize) )
+        map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if ( map == MAP_FAILED )
+        return false;
+
+    m_map = static_cast<const unsigned char*>(map);
+    m_size = st.st_size;
+
+    const LcdExportHeader *h = export_header(m_map);
+
+    if (
+            memcmp(h->magic, export_magic, sizeof(export_magic))
+        ||
+            h->version != quint32(LcdExport::Version)
+        ||
+            !h->slotCount
+        ||
+            m_size < LcdExport::HeaderSize + size_t(h->slotCount) * h->slotSize
+        ||
+            int(h->slotSize) < LcdExport::slotSize(h->width, h->height)
+        )
+    {
+        close();
+        return false;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return true;
+#else
+    Q_UNUSED(name)
+    return false;
+#endif
+}
+
+void LcdExportReader::close()
+{
+#ifdef LCD_EXPORT_SHM
+    if ( m_map )
+        munmap(const_cast<unsigned char*>(m_map), m_size);
+#endif
+
+    m_map = 0;
+    m_size = 0;
+}
+
+bool LcdExportReader::isOpen() const
+{
+    return m_map;
+}
+
+int LcdExportReader::width() const
+{
+    return m_map ? export_header(m_map)->width : 0;
+}
+
+int LcdExportReader::height() const
+{
+    return m_map ? export_header(m_map)->height : 0;
+}
+
+/**
+ * @brief Sequence number of the newest frame, to skip frames already seen
+ *
+ * @return 0 if there is none
+ */
+quint64 LcdExportReader::latest() const
+{
+    return m_map ? export_header(m_map)->latest.loadAcquire() : 0;
+}
+
+/**
+ * @brief Locate the newest frame, in place
+ *
+ * @param f
+ *
+ * @return false if there is no frame, or it is being written right now
+ */
+bool LcdExportReader::begin(Frame& f) const
+{
+    const quint64 seq = latest();
+
+    if ( !seq )
+        return false;
+
+    const LcdExportHeader *h = export_header(m_map);
+
+    f.slot = reinterpret_cast<const LcdExportSlot*>(m_map + LcdExport::HeaderSize + (seq % h->slotCount) * h->slotSize);
+    f.lock = f.slot->lock.loadAcquire();
+
+    if ( f.lock & 1 )
+        return false;
+
+    f.sequence = f.slot->sequence;
+    f.cycles = f.slot->cycles;
+    f.gray = reinterpret_cast<const unsigned char*>(f.slot + 1);
+
+    // the writer went round the ring since latest() was read
+    return f.sequence == seq;
+}
+
+/**
+ * @brief Whether a frame from begin() was left alone since, anything read from it before is good
+ *
+ * @param f
+ *
+ * @return
+ */
+bool LcdExportReader::isIntact(const Frame& f) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return f.slot->lock.load() == f.lock;
+}
+
+/**
+ * @brief Copy the newest frame
+ *
+ * @param gray width() * height() intensities
+ * @param sequence
+ * @param cycles
+ *
+ * @return false if there is no frame yet, or the writer kept overwriting it
+ */
+bool LcdExportReader::read(QByteArray& gray, quint64 *sequence, quint64 *cycles) const
+{
+    if ( !m_map )
+        return false;
+
+    const int bytes = width() * height();
+
+    gray.resize(bytes);
+
+    for ( int attempt = 0; attempt < 100; ++attempt )
+    {
+        Frame f;
+
+        if ( !begin(f) )
+        {
+            if ( !latest() )
+                return false;
+
+            continue;
+        }
+
+        memcpy(gray.data(), f.gray, bytes);
+
+        if ( isIntact(f) )
+        {
+            if ( sequence )
+                *sequence = f.sequence;
+
+            if ( cycles )
+                *cycles = f.cycles;
+
+            return true;
+        }
+    }
+
+    return false;
+}
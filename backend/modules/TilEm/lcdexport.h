@@ -0,0 +1,123 @@
+#ifndef LCDEXPORT_H
+#define LCDEXPORT_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QString>
+
+/*!
+    \class LcdExport
+    \brief Publishes the gray LCD frames of a calc into POSIX shared memory
+
+    Other processes (test dashboards, recorders...) map the same object and
+    read the latest frame in place, whenever they like, without any IPC per
+    frame. The object holds a small header followed by a ring of slots, each
+    guarded by a sequence lock so readers can tell a torn frame from a good
+    one without ever blocking the writer :
+
+        offset 0   LcdExportHeader
+        offset 64  slotCount slots of slotSize bytes : LcdExportSlot, then
+                   width * height intensities (0 black, 255 white)
+
+    The latest frame lives in slot (latest % slotCount). See
+    LcdExportReader for the reading side.
+*/
+
+struct LcdExportHeader
+{
+    // "TILEMLCD"
+    char magic[8];
+    quint32 version;
+
+    quint32 width, height;
+    quint32 slotCount, slotSize;
+    quint32 reserved;
+
+    // sequence number of the newest complete frame, 0 before the first one
+    QAtomicInteger<quint64> latest;
+};
+
+struct LcdExportSlot
+{
+    // odd while the slot is being written
+    QAtomicInteger<quint64> lock;
+
+    // frame sequence number (see LcdFrame) and emulated clock cycles when it was completed
+    quint64 sequence;
+    quint64 cycles;
+};
+
+class LcdExport
+{
+    public:
+        enum
+        {
+            Version = 1,
+            SlotCount = 4,
+            HeaderSize = 64
+        };
+
+        LcdExport();
+        ~LcdExport();
+
+        bool create(const QString& name, int width, int height);
+        void close();
+
+        bool isOpen() const;
+        QString name() const;
+
+        void publish(const QByteArray& gray, quint64 sequence, quint64 cycles);
+
+        static QByteArray shmName(const QString& name);
+        static int slotSize(int width, int height);
+
+    private:
+        QString m_name;
+        unsigned char *m_map;
+        size_t m_size;
+};
+
+/*!
+    \class LcdExportReader
+    \brief Reading side of an LcdExport, possibly in another process
+
+    For zero copy access, begin() hands out a pointer into the shared
+    memory and isIntact() tells afterwards whether the frame was left
+    alone while it was being used. read() does that for a plain copy.
+*/
+class LcdExportReader
+{
+    public:
+        struct Frame
+        {
+            const unsigned char *gray;
+            quint64 sequence, cycles;
+
+            // lock value seen by begin()
+            quint64 lock;
+            const LcdExportSlot *slot;
+        };
+
+        LcdExportReader();
+        ~LcdExportReader();
+
+        bool open(const QString& name);
+        void close();
+
+        bool isOpen() const;
+        int width() const;
+        int height() const;
+
+        quint64 latest() const;
+
+        bool begin(Frame& f) const;
+        bool isIntact(const Frame& f) const;
+
+        bool read(QByteArray& gray, quint64 *sequence = 0, quint64 *cycles = 0) const;
+
+    private:
+        const unsigned char *m_map;
+        size_t m_size;
+};
+
+#endif // LCDEXPORT_H
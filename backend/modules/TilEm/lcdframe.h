@@ -0,0 +1,126 @@
+#ifndef LCDFRAME_H
+#define LCDFRAME_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+
+/*!
+    \class LcdFrame
+    \brief One complete grayscale frame of the calc LCD, see LcdGray
+*/
+struct LcdFrame
+{
+    LcdFrame()
+     : sequence(0), hash(0), width(0), height(0)
+    {
+    }
+
+    // increases with every frame published, equal numbers mean the same frame
+    quint64 sequence;
+
+    // of gray, equal hashes mean the same picture
+    quint64 hash;
+
+    int width, height;
+
+    // 1 byte per pixel, 0 is black
+    QByteArray gray;
+};
+
+/*!
+    \class LcdFrameQueue
+    \brief Lock-free triple buffer of LcdFrame, one producer and one consumer
+
+    The producer (emulation thread) fills back() and publish()es it, the
+    consumer (GUI thread) calls update() to take the latest published
+    frame, which then stays in front() untouched until its next update().
+    The three slots change hands through a single atomic index swap, so
+    neither side ever waits for the other, frames are never torn and
+    frames the consumer was too slow for are simply dropped.
+
+    Slots are allocated once by reset(), never while frames flow.
+*/
+class LcdFrameQueue
+{
+    public:
+        LcdFrameQueue()
+         : m_middle(1), m_back(0), m_front(2)
+        {
+        }
+
+        /*!
+            \brief Resize every slot and forget published frames, neither side may be using the queue
+        */
+        void reset(int width, int height)
+        {
+            for ( int i = 0; i < 3; ++i )
+            {
+                LcdFrame& f = m_slots[i];
+
+                f.sequence = 0;
+                f.hash = 0;
+                f.width = width;
+                f.height = height;
+                f.gray = QByteArray(width * height, char(0xff));
+            }
+
+            m_back = 0;
+            m_middle.storeRelease(1);
+            m_front = 2;
+        }
+
+        /*!
+            \brief Slot the producer writes the next frame into
+        */
+        LcdFrame& back()
+        {
+            return m_slots[m_back];
+        }
+
+        /*!
+            \brief Hand back() over to the consumer and get a free slot instead
+        */
+        void publish()
+        {
+            m_back = m_middle.fetchAndStoreAcqRel(m_back | Fresh) & Index;
+        }
+
+        /*!
+            \brief Move the latest published frame to front(), if there is a new one
+
+            \return whether front() changed
+        */
+        bool update()
+        {
+            if ( !(m_middle.loadAcquire() & Fresh) )
+                return false;
+
+            m_front = m_middle.fetchAndStoreAcqRel(m_front) & Index;
+            return true;
+        }
+
+        /*!
+            \brief Latest frame taken by update()
+        */
+        const LcdFrame& front() const
+        {
+            return m_slots[m_front];
+        }
+
+    private:
+        enum
+        {
+            Index = 3,
+            Fresh = 4
+        };
+
+        LcdFrame m_slots[3];
+
+        // slot between the two sides, with Fresh when it was published and not taken yet
+        QAtomicInt m_middle;
+
+        // only ever touched by their own side
+        int m_back, m_front;
+};
+
+#endif // LCDFRAME_H
@@ -0,0 +1,269 @@
+#include "lcdgray.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LCD_GRAY_X86
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LCD_GRAY_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+    Copy kernels of LcdGray::update(), 16 pixels (one dirty flag) at a time
+*/
+
+static bool update_scalar(const unsigned char *src, unsigned char *level, unsigned char *dirty, int count)
+{
+    bool changed = false;
+
+    for ( int i = 0, k = 0; i < count; i += 16, ++k )
+    {
+        const int n = qMin(16, count - i);
+
+        if ( memcmp(src + i, level + i, n) )
+        {
+            memcpy(level + i, src + i, n);
+            dirty[k] = 1;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+#ifdef LCD_GRAY_X86
+
+__attribute__((target("sse2")))
+static bool update_sse2(const unsigned char *src, unsigned char *level, unsigned char *dirty, int count)
+{
+    bool changed = false;
+    int i = 0;
+
+    for ( ; i + 16 <= count; i += 16 )
+    {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(level + i));
+
+        if ( _mm_movemask_epi8(_mm_cmpeq_epi8(s, l)) == 0xffff )
+            continue;
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(level + i), s);
+        dirty[i >> 4] = 1;
+        changed = true;
+    }
+
+    if ( i < count && update_scalar(src + i, level + i, dirty + (i >> 4), count - i) )
+        changed = true;
+
+    return changed;
+}
+
+#endif // LCD_GRAY_X86
+
+#ifdef LCD_GRAY_NEON
+
+static bool update_neon(const unsigned char *src, unsigned char *level, unsigned char *dirty, int count)
+{
+    bool changed = false;
+    int i = 0;
+
+    for ( ; i + 16 <= count; i += 16 )
+    {
+        const uint8x16_t s = vld1q_u8(src + i);
+        const uint64x2_t d = vreinterpretq_u64_u8(veorq_u8(s, vld1q_u8(level + i)));
+
+        if ( !(vgetq_lane_u64(d, 0) | vgetq_lane_u64(d, 1)) )
+            continue;
+
+        vst1q_u8(level + i, s);
+        dirty[i >> 4] = 1;
+        changed = true;
+    }
+
+    if ( i < count && update_scalar(src + i, level + i, dirty + (i >> 4), count - i) )
+        changed = true;
+
+    return changed;
+}
+
+#endif // LCD_GRAY_NEON
+
+typedef bool (*UpdateFunc)(const unsigned char *src, unsigned char *level, unsigned char *dirty, int count);
+
+struct UpdateKernel
+{
+    const char *name;
+    UpdateFunc update;
+};
+
+static UpdateKernel resolve_kernel()
+{
+    // best first
+    UpdateKernel kernels[3];
+    int n = 0;
+
+#ifdef LCD_GRAY_X86
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports("sse2") )
+    {
+        kernels[n].name = "sse2";
+        kernels[n++].update = update_sse2;
+    }
+#endif
+
+#ifdef LCD_GRAY_NEON
+    kernels[n].name = "neon";
+    kernels[n++].update = update_neon;
+#endif
+
+    kernels[n].name = "scalar";
+    kernels[n++].update = update_scalar;
+
+    const char *forced = getenv("TILEM_LCD_KERNEL");
+
+    for ( int k = 0; forced && k < n; ++k )
+        if ( !strcmp(forced, kernels[k].name) )
+            return kernels[k];
+
+    return kernels[0];
+}
+
+static const UpdateKernel& kernel()
+{
+    static const UpdateKernel k = resolve_kernel();
+    return k;
+}
+
+LcdGray::LcdGray()
+ : m_pixels(0), m_words(0), m_count(0)
+{
+}
+
+/**
+ * @brief Start over with an empty window
+ *
+ * @param pixels Number of LCD pixels, a multiple of 8
+ */
+void LcdGray::reset(int pixels)
+{
+    m_pixels = pixels;
+    m_words = (pixels / 8 + 7) / 8;
+    m_count = 0;
+
+    m_planes.fill(0, Planes * m_words);
+}
+
+/**
+ * @brief Number of samples in the current window
+ *
+ * @return
+ */
+int LcdGray::count() const
+{
+    return m_count;
+}
+
+/**
+ * @brief Add one sample of the plain LCD
+ *
+ * @param bits 1 bit per pixel, MSB first, set bits are dark
+ *
+ * @return whether the window is complete, levels() can then be read before the next reset()
+ */
+bool LcdGray::sample(const unsigned char *bits)
+{
+    if ( m_count >= Samples )
+        return true;
+
+    const int bytes = m_pixels / 8;
+    quint64 *planes = m_planes.data();
+
+    for ( int i = 0; i < m_words; ++i )
+    {
+        quint64 carry = 0;
+        const int n = qMin(8, bytes - i * 8);
+
+        // byte order does not matter : every bit is its own counter
+        memcpy(&carry, bits + i * 8, n);
+
+        for ( int p = 0; carry && p < Planes; ++p )
+        {
+            quint64& w = planes[p * m_words + i];
+            const quint64 t = w & carry;
+
+            w ^= carry;
+            carry = t;
+        }
+    }
+
+    return ++m_count >= Samples;
+}
+
+/**
+ * @brief Turn the counts of the window into intensities
+ *
+ * @param level m_pixels intensities, 0 is black
+ */
+void LcdGray::levels(unsigned char *level) const
+{
+    const unsigned char *planes = reinterpret_cast<const unsigned char*>(m_planes.constData());
+    const int stride = m_words * 8;
+    const int n = qMax(1, m_count);
+
+    unsigned char table[Samples + 1];
+
+    for ( int c = 0; c <= Samples; ++c )
+        table[c] = 255 - qMin(c, n) * 255 / n;
+
+    for ( int b = 0; b < m_pixels / 8; ++b )
+    {
+        unsigned char v[Planes];
+
+        for ( int p = 0; p < Planes; ++p )
+            v[p] = planes[p * stride + b];
+
+        for ( int k = 0; k < 8; ++k )
+        {
+            int c = 0;
+
+            for ( int p = 0; p < Planes; ++p )
+                c |= ((v[p] >> (7 - k)) & 1) << p;
+
+            level[b * 8 + k] = table[c];
+        }
+    }
+}
+
+/**
+ * @brief Copy new intensities over the displayed ones
+ *
+ * @param src New intensities
+ * @param level Displayed intensities, updated in place
+ * @param dirty One flag per group of 16 pixels, set for groups where a pixel changed, never cleared
+ * @param count Number of pixels
+ *
+ * @return whether any pixel changed
+ */
+bool LcdGray::update(const unsigned char *src, unsigned char *level, unsigned char *dirty, int count)
+{
+    return kernel().update(src, level, dirty, count);
+}
+
+/**
+ * @brief Name of the kernel used by update() : sse2, neon or scalar
+ *
+ * Picked for the host CPU on first use, the TILEM_LCD_KERNEL environment
+ * variable forces one.
+ *
+ * @return
+ */
+const char* LcdGray::kernelName()
+{
+    return kernel().name;
+}
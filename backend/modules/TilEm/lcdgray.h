@@ -0,0 +1,53 @@
+#ifndef LCDGRAY_H
+#define LCDGRAY_H
+
+#include <QVector>
+
+/*!
+    \class LcdGray
+    \brief Grayscale accumulator for the calc LCD
+
+    Grayscale programs flicker pixels between frames. The emulation thread
+    samples the plain LCD every SampleUsec of emulated time and adds each
+    sample to per pixel counters kept as bit planes : plane p holds bit p
+    of the count of every pixel, 64 pixels per word, so adding a sample is
+    a ripple carry of a few AND / XOR per word. After Samples samples the
+    counts turn into gray levels and a new window starts.
+
+    The result only depends on emulated time, not on how often or how late
+    the GUI looks at it.
+*/
+class LcdGray
+{
+    public:
+        enum
+        {
+            // 16 samples 1.25 ms apart : one gray frame every 20 ms of emulated time
+            Samples = 16,
+            SampleUsec = 1250,
+
+            // enough bits to count up to Samples
+            Planes = 5
+        };
+
+        LcdGray();
+
+        void reset(int pixels);
+
+        int count() const;
+
+        bool sample(const unsigned char *bits);
+
+        void levels(unsigned char *level) const;
+
+        static bool update(const unsigned char *src, unsigned char *level, unsigned char *dirty, int count);
+        static const char* kernelName();
+
+    private:
+        int m_pixels, m_words, m_count;
+
+        // Planes planes of m_words words
+        QVector<quint64> m_planes;
+};
+
+#endif // LCDGRAY_H
@@ -21,45 +21,70 @@
 */
 
 #include <stdint.h>
+#include <string.h>
 
 #include <QByteArray>
-#include <QReadWriteLock>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
 
 /*!
 	\class LinkBuffer
 	\brief A small container class tailored for internal use in Calc
 	
-	It is basically a circular queue of bytes which offers maximum
-	performance when working with a number of items inferior to the
-	nominal value of 1024 and will slow down beyond that because it
-	falls back on a dynamic container to hold the "overflowing" data.
+	It is a lock-free queue of bytes with exactly one producer thread and
+	one consumer thread (calc thread and link thread, in either direction).
 	
-	\note This container is thread-safe
+	Bytes live in a chain of power-of-two rings : the producer fills the
+	last ring and, when it is full, chains a ring twice as large instead of
+	waiting; the consumer drains the first one and frees it once the
+	producer has moved on. Each ring has a write index, owned by the
+	producer, and a read index, owned by the consumer, on separate cache
+	lines. Bulk read() and write() copy whole spans with at most two
+	memcpy per ring.
+	
+	\note count() and isEmpty() may be called from any thread, everything
+	else that reads is for the consumer and everything that appends for
+	the producer.
 */
 
 class LinkBuffer
 {
 	public:
+		enum
+		{
+			FirstSegment = 1024,
+			MaxSegment = 1 << 20
+		};
+		
 		inline LinkBuffer()
+		 : m_count(0)
 		{
-			m_base = m_count = 0;
+			m_read = m_write = new Segment(FirstSegment);
 		}
 		
 		~LinkBuffer()
 		{
-			
+			while ( m_read )
+			{
+				Segment *next = m_read->next.loadAcquire();
+				delete m_read;
+				m_read = next;
+			}
 		}
 		
 		inline bool isEmpty() const
 		{
-			QReadLocker l(&m_lock);
-			return !m_count;
+			return !count();
 		}
 		
+		/*!
+			\brief Number of bytes the consumer can read right now, never more than what is there
+		*/
 		inline uint32_t count() const
 		{
-			QReadLocker l(&m_lock);
-			return m_count;
+			// briefly negative when the consumer got to bytes before the producer counted them
+			return qMax(0, m_count.loadAcquire());
 		}
 		
 		QByteArray take(uint32_t count)
@@ -67,93 +92,181 @@ class LinkBuffer
 			QByteArray b;
 			b.resize(count);
 			
-			for ( uint32_t i = 0; i < count; ++i )
-				b[i] = at(i);
-			
-			remove(count);
+			b.resize(read(b.data(), count));
 			
 			return b;
 		}
 		
 		void take(uint32_t count, char *d)
 		{
-			for ( uint32_t i = 0; i < count; ++i )
-				d[i] = at(i);
-			
-			remove(count);
+			read(d, count);
 		}
 		
 		void remove(uint32_t count)
 		{
-			QWriteLocker l(&m_lock);
-			
-			m_base = (m_base + count) & 1023;
-			
-			if ( m_count >= count )
+			read(0, count);
+		}
+		
+		/*!
+			\brief Peek at a byte without removing it, consumer side
+		*/
+		char at(uint32_t idx) const
+		{
+			for ( const Segment *s = m_read; s; s = s->next.loadAcquire() )
 			{
-				m_count -= count;
-			} else {
-				m_overflow.remove(0, count - m_count);
-				m_count = 0;
+				const uint32_t tail = s->tail.load();
+				const uint32_t n = s->head.loadAcquire() - tail;
+				
+				if ( idx < n )
+					return s->data[(tail + idx) & s->mask];
+				
+				idx -= n;
 			}
 			
-			uint32_t n = qMin(1024 - m_count, uint32_t(m_overflow.count()));
+			return 0;
+		}
+		
+		/*!
+			\brief Remove up to n bytes from the front, consumer side
+			\param d Where to copy them, may be 0 to drop them
+			\return number of bytes removed
+		*/
+		uint32_t read(char *d, uint32_t n)
+		{
+			uint32_t done = 0;
 			
-			if ( n )
+			while ( done < n )
 			{
-				// bring back overflow into data
+				Segment *s = m_read;
+				
+				const uint32_t tail = s->tail.load();
+				const uint32_t head = s->head.loadAcquire();
+				
+				if ( head == tail )
+				{
+					Segment *next = s->next.loadAcquire();
+					
+					if ( !next )
+						break;
+					
+					// the producer moved on, but may have filled this one up first
+					if ( s->head.loadAcquire() != tail )
+						continue;
+					
+					m_read = next;
+					delete s;
+					continue;
+				}
 				
-				for ( uint32_t i = 0; i < n; ++i )
-					append(m_overflow.at(i));
+				const uint32_t chunk = qMin(head - tail, n - done);
+				const uint32_t off = tail & s->mask;
+				const uint32_t first = qMin(chunk, s->mask + 1 - off);
 				
-				m_overflow.remove(0, n);
+				if ( d )
+				{
+					memcpy(d + done, s->data + off, first);
+					memcpy(d + done + first, s->data, chunk - first);
+				}
+				
+				s->tail.storeRelease(tail + chunk);
+				done += chunk;
 			}
+			
+			if ( done )
+				m_count.fetchAndAddOrdered(-int(done));
+			
+			return done;
 		}
 		
-		inline char at(uint32_t idx) const
+		/*!
+			\brief Append n bytes, producer side, never blocks
+		*/
+		void write(const char *d, uint32_t n)
 		{
-			QReadLocker l(&m_lock);
-			return idx < 1024 ? m_d[(m_base + idx) & 1023] : m_overflow.at(idx - 1024);
+			uint32_t done = 0;
+			
+			while ( done < n )
+			{
+				Segment *s = m_write;
+				
+				const uint32_t head = s->head.load();
+				const uint32_t size = s->mask + 1;
+				const uint32_t free = size - (head - s->tail.loadAcquire());
+				
+				if ( !free )
+				{
+					// grow instead of waiting for the consumer
+					Segment *next = new Segment(qMin(size * 2, uint32_t(MaxSegment)));
+					s->next.storeRelease(next);
+					m_write = next;
+					continue;
+				}
+				
+				const uint32_t chunk = qMin(free, n - done);
+				const uint32_t off = head & s->mask;
+				const uint32_t first = qMin(chunk, size - off);
+				
+				memcpy(s->data + off, d + done, first);
+				memcpy(s->data, d + done + first, chunk - first);
+				
+				s->head.storeRelease(head + chunk);
+				done += chunk;
+			}
+			
+			if ( n )
+				m_count.fetchAndAddOrdered(int(n));
 		}
 		
 		inline LinkBuffer& operator += (char c)
 		{
-			QWriteLocker l(&m_lock);
-			
-			append(c);
+			write(&c, 1);
 			
 			return *this;
 		}
 		
 		inline LinkBuffer& operator += (const QByteArray& ba)
 		{
-			QWriteLocker l(&m_lock);
-			
-			const int c = ba.count();
-			for ( int i = 0; i < c; ++i )
-				append(ba.at(i));
+			write(ba.constData(), ba.count());
 			
 			return *this;
 		}
 		
 	private:
-		inline void append(char c)
+		Q_DISABLE_COPY(LinkBuffer)
+		
+		struct Segment
 		{
-			if ( m_count == 1024 )
+			Segment(uint32_t size)
+			 : head(0), tail(0), next(0), mask(size - 1), data(new char[size])
 			{
-				// keep overflowing data
-				m_overflow += c;
-			} else {
-				m_d[(m_base + m_count) & 1023] = c;
-				++m_count;
 			}
-		}
+			
+			~Segment()
+			{
+				delete[] data;
+			}
+			
+			// free running indices, producer and consumer side, a cache line apart
+			QAtomicInteger<uint32_t> head;
+			char pad0[64 - sizeof(QAtomicInteger<uint32_t>)];
+			
+			QAtomicInteger<uint32_t> tail;
+			char pad1[64 - sizeof(QAtomicInteger<uint32_t>)];
+			
+			QAtomicPointer<Segment> next;
+			
+			const uint32_t mask;
+			char *data;
+		};
+		
+		// owned by the consumer and the producer
+		Segment *m_read;
+		char m_pad0[64 - sizeof(Segment*)];
 		
-		uint32_t m_base, m_count;
-		char m_d[1024];
-		QByteArray m_overflow;
+		Segment *m_write;
+		char m_pad1[64 - sizeof(Segment*)];
 		
-		mutable QReadWriteLock m_lock;
+		QAtomicInt m_count;
 };
 
 #endif
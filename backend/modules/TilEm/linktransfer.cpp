@@ -0,0 +1,278 @@
+#include "linktransfer.h"
+#include "calclink.h"
+
+#include <QFileInfo>
+
+/**
+ * @brief A file to send
+ *
+ * @param c
+ * @param file
+ * @param p
+ */
+LinkTransfer::LinkTransfer(Calc *c, const QString& file, QObject *p)
+ : QObject(p), m_file(file), m_calc(c), m_direction(Send), m_contents(0), m_state(Queued),
+   m_bytesDone(0), m_bytesTotal(QFileInfo(file).size()), m_throughput(0), m_abort(0), m_lastProgress(0)
+{
+}
+
+/**
+ * @brief A dump to receive
+ *
+ * @param c
+ * @param directory Created if need be, existing files are overwritten
+ * @param contents Content flags
+ * @param filter Wildcard matched against file names, case insensitive
+ * @param p
+ */
+LinkTransfer::LinkTransfer(Calc *c, const QString& directory, int contents, const QString& filter, QObject *p)
+ : QObject(p), m_file(directory), m_calc(c), m_direction(Receive), m_contents(contents),
+   m_filter(filter.isEmpty() ? QString("*") : filter), m_state(Queued),
+   m_bytesDone(0), m_bytesTotal(0), m_throughput(0), m_abort(0), m_lastProgress(0)
+{
+}
+
+LinkTransfer::~LinkTransfer()
+{
+}
+
+QString LinkTransfer::file() const
+{
+    return m_file;
+}
+
+Calc* LinkTransfer::calc() const
+{
+    return m_calc;
+}
+
+LinkTransfer::Direction LinkTransfer::direction() const
+{
+    return m_direction;
+}
+
+int LinkTransfer::contents() const
+{
+    return m_contents;
+}
+
+QString LinkTransfer::filter() const
+{
+    return m_filter;
+}
+
+/**
+ * @brief Files written by a receive transfer so far
+ *
+ * @return
+ */
+QStringList LinkTransfer::files() const
+{
+    QMutexLocker l(&m_lock);
+    return m_files;
+}
+
+LinkTransfer::State LinkTransfer::state() const
+{
+    return State(m_state.load());
+}
+
+bool LinkTransfer::isFinished() const
+{
+    const State s = state();
+
+    return s != Queued && s != Running;
+}
+
+/**
+ * @brief Why the transfer failed
+ *
+ * @return
+ */
+QString LinkTransfer::error() const
+{
+    QMutexLocker l(&m_lock);
+    return m_error;
+}
+
+qint64 LinkTransfer::bytesDone() const
+{
+    return m_bytesDone.load();
+}
+
+/**
+ * @brief Size of the file to send, or of the variables to receive once they are known
+ *
+ * @return
+ */
+qint64 LinkTransfer::bytesTotal() const
+{
+    return m_bytesTotal.load();
+}
+
+/**
+ * @brief Fraction of the file sent so far
+ *
+ * @return Between 0 and 1, exactly 1 once done
+ */
+qreal LinkTransfer::progress() const
+{
+    if ( state() == Done )
+        return 1.;
+
+    const qint64 total = bytesTotal();
+
+    if ( total <= 0 )
+        return 0.;
+
+    return qMin(qreal(0.99), qreal(bytesDone()) / total);
+}
+
+/**
+ * @brief Average speed since the transfer started
+ *
+ * @return bytes per second of host time
+ */
+qreal LinkTransfer::throughput() const
+{
+    return m_throughput.load();
+}
+
+/**
+ * @brief Drop the transfer if it is still queued, interrupt it if it is running
+ */
+void LinkTransfer::cancel()
+{
+    if ( isFinished() )
+        return;
+
+    // still queued : taken out, and reported, by the link
+    if ( m_calc && m_calc->link() && m_calc->link()->unqueue(this) )
+        return;
+
+    // the link thread has it : begin() fails or the cable gives up
+    m_abort.storeRelease(1);
+
+    // break the cable out of its waits
+    if ( m_calc )
+        m_calc->abortLinkWaits();
+}
+
+/**
+ * @brief Whether cancel() was called
+ *
+ * @return
+ */
+bool LinkTransfer::isCancelled() const
+{
+    return m_abort.loadAcquire() || state() == Cancelled;
+}
+
+/**
+ * @brief Set by cancel(), for Calc::waitForBytes() and Calc::waitForDrained()
+ *
+ * @return
+ */
+const QAtomicInt* LinkTransfer::abortFlag() const
+{
+    return &m_abort;
+}
+
+/**
+ * @brief Set the size of a receive transfer, from the link thread
+ *
+ * @param total
+ */
+void LinkTransfer::setBytesTotal(qint64 total)
+{
+    m_bytesTotal.store(total);
+
+    notify("progressChanged");
+}
+
+/**
+ * @brief Record a file written by a receive transfer, from the link thread
+ *
+ * @param file
+ */
+void LinkTransfer::addFile(const QString& file)
+{
+    m_lock.lock();
+    m_files << file;
+    m_lock.unlock();
+
+    notify("progressChanged");
+}
+
+/*
+    Called by the link thread, false if the transfer was cancelled after it
+    was taken out of the queue : it must then be finish()ed as Cancelled
+*/
+bool LinkTransfer::begin()
+{
+    if ( m_abort.loadAcquire() || !m_state.testAndSetOrdered(Queued, Running) )
+        return false;
+
+    m_clock.start();
+    m_lastProgress = 0;
+
+    notify("stateChanged");
+
+    return true;
+}
+
+/**
+ * @brief Count bytes that went through the link, called by the link thread
+ *
+ * @param count
+ */
+void LinkTransfer::addBytes(int count)
+{
+    const qint64 done = m_bytesDone.fetchAndAddRelaxed(count) + count;
+    const qint64 now = m_clock.elapsed();
+
+    if ( now - m_lastProgress < ProgressInterval )
+        return;
+
+    m_lastProgress = now;
+    m_throughput.store(now ? done * 1000 / now : 0);
+
+    notify("progressChanged");
+}
+
+/*
+    Called by the link once the transfer is over, or dropped from its queue.
+    The last the link does with it : the transfer may be deleted as soon as
+    finished() is delivered.
+*/
+void LinkTransfer::finish(State s, const QString& error)
+{
+    const qint64 now = m_clock.isValid() ? m_clock.elapsed() : 0;
+
+    if ( now )
+        m_throughput.store(bytesDone() * 1000 / now);
+
+    m_lock.lock();
+    m_error = error;
+    m_lock.unlock();
+
+    m_state.store(s);
+
+    notify("notifyFinished");
+}
+
+void LinkTransfer::notifyFinished()
+{
+    emit progressChanged();
+    emit stateChanged();
+    emit finished();
+}
+
+/*
+    Emit a signal (or call a slot) in the thread of the transfer, whichever
+    thread the link layer calls from
+*/
+void LinkTransfer::notify(const char *signal)
+{
+    QMetaObject::invokeMethod(this, signal, Qt::QueuedConnection);
+}
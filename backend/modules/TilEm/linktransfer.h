@@ -0,0 +1,152 @@
+#ifndef LINKTRANSFER_H
+#define LINKTRANSFER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QMutex>
+#include <QStringList>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+
+#include "calc.h"
+
+/*!
+    \class LinkTransfer
+    \brief One file sent to a calc, or one dump received from it, through its link port
+
+    Created by CalcLink::send() or TransferManager and queued on the
+    CalcLink of the target calc, which runs its transfers one after the
+    other from its own thread : transfers to different calcs run
+    concurrently.
+
+    A send transfer reads file(). A receive transfer writes into the
+    directory file() the contents() of the calc whose file name (as built
+    by tifiles, e.g. PRGM.8xp) matches filter(), one file per variable or
+    app : each one is saved as soon as it has been received, never the
+    whole dump at once. files() lists what was written so far.
+
+    Progress is counted in bytes going through the emulated link port.
+    The total is the size of the file, or of the variables to receive,
+    which the link protocol overhead makes a slight underestimate, so
+    progress is capped until the transfer is done. Properties may be read
+    from any thread. Signals are always delivered in the thread of the
+    transfer (progressChanged() at most every ProgressInterval ms), and
+    finished() is delivered once the link thread is done with it : only
+    then may it be deleted.
+*/
+class LinkTransfer : public QObject
+{
+    friend class FileSender;
+
+    Q_OBJECT
+        Q_ENUMS(State Direction Content)
+        Q_PROPERTY(QString file READ file CONSTANT)
+        Q_PROPERTY(Calc* calc READ calc CONSTANT)
+        Q_PROPERTY(Direction direction READ direction CONSTANT)
+        Q_PROPERTY(int contents READ contents CONSTANT)
+        Q_PROPERTY(QString filter READ filter CONSTANT)
+        Q_PROPERTY(QStringList files READ files NOTIFY progressChanged)
+        Q_PROPERTY(State state READ state NOTIFY stateChanged)
+        Q_PROPERTY(bool finished READ isFinished NOTIFY stateChanged)
+        Q_PROPERTY(QString error READ error NOTIFY stateChanged)
+        Q_PROPERTY(qint64 bytesDone READ bytesDone NOTIFY progressChanged)
+        Q_PROPERTY(qint64 bytesTotal READ bytesTotal NOTIFY progressChanged)
+        Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged)
+        Q_PROPERTY(qreal throughput READ throughput NOTIFY progressChanged)
+
+    public:
+        enum State
+        {
+            Queued,
+            Running,
+            Done,
+            Failed,
+            Cancelled
+        };
+
+        enum Direction
+        {
+            Send,
+            Receive
+        };
+
+        // what a receive transfer dumps, or-ed together
+        enum Content
+        {
+            Variables = 1,
+            Apps = 2,
+            Backup = 4
+        };
+
+        enum
+        {
+            ProgressInterval = 100
+        };
+
+        LinkTransfer(Calc *c, const QString& file, QObject *p = 0);
+        LinkTransfer(Calc *c, const QString& directory, int contents, const QString& filter, QObject *p = 0);
+        ~LinkTransfer();
+
+        QString file() const;
+        Calc* calc() const;
+
+        Direction direction() const;
+        int contents() const;
+        QString filter() const;
+        QStringList files() const;
+
+        State state() const;
+        bool isFinished() const;
+        QString error() const;
+
+        qint64 bytesDone() const;
+        qint64 bytesTotal() const;
+        qreal progress() const;
+        qreal throughput() const;
+
+        // for the link layer, from the link thread
+        void addBytes(int count);
+        void setBytesTotal(qint64 total);
+        void addFile(const QString& file);
+        bool isCancelled() const;
+        const QAtomicInt* abortFlag() const;
+
+    public slots:
+        void cancel();
+
+    Q_SIGNALS:
+        void stateChanged();
+        void progressChanged();
+        void finished();
+
+    private slots:
+        void notifyFinished();
+
+    private:
+        bool begin();
+        void finish(State s, const QString& error = QString());
+        void notify(const char *signal);
+
+        QString m_file;
+        QPointer<Calc> m_calc;
+
+        Direction m_direction;
+        int m_contents;
+        QString m_filter;
+
+        QAtomicInt m_state;
+        QAtomicInteger<qint64> m_bytesDone, m_bytesTotal, m_throughput;
+
+        // checked by the link waits, see Calc::waitForBytes()
+        QAtomicInt m_abort;
+
+        mutable QMutex m_lock;
+        QString m_error;
+        QStringList m_files;
+
+        // link thread only
+        QElapsedTimer m_clock;
+        qint64 m_lastProgress;
+};
+
+#endif // LINKTRANSFER_H
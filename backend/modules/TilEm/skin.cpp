@@ -8,6 +8,7 @@
 #include <QPixmap>
 #include <QImage>
 #include "skinimage.h"
+#include "skinops.h"
 
 #include <scancodes.h>
 
@@ -93,6 +94,28 @@ QImage *Skin::getSkinImage()
     return m_settings.image();
 }
 
+/**
+ * @brief Colour of dark LCD pixels, from the skin when it defines custom LCD colours
+ */
+QColor Skin::lcdBlack() const
+{
+    if ( m_settings.colorType() == LCD_COLORTYPE_CUSTOM )
+        return QColor(QRgb(m_settings.lcdBlack()));
+
+    return QColor(Qt::black);
+}
+
+/**
+ * @brief Colour of blank LCD pixels, from the skin when it defines custom LCD colours
+ */
+QColor Skin::lcdWhite() const
+{
+    if ( m_settings.colorType() == LCD_COLORTYPE_CUSTOM )
+        return QColor(QRgb(m_settings.lcdWhite()));
+
+    return QColor(Qt::white);
+}
+
 int Skin::keyCode(int x, int y)
 {
     qDebug() << "get keycode " << x << "x" << y;
@@ -149,6 +172,8 @@ void Skin::loadSkin()
     emit authorChanged(author());
     emit scaleXChanged(scaleX());
     emit scaleYChanged(scaleY());
+    emit lcdBlackChanged(lcdBlack());
+    emit lcdWhiteChanged(lcdWhite());
 }
 
 void Skin::emitLcdChanged()
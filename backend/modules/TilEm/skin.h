@@ -2,6 +2,7 @@
 #define SKIN_H
 
 #include <QObject>
+#include <QColor>
 #include <QPoint>
 #include <QPolygon>
 
@@ -26,6 +27,8 @@ class Skin : public QObject
     Q_PROPERTY(int width READ width NOTIFY widthChanged)
     Q_PROPERTY(int scaleX READ scaleX NOTIFY scaleXChanged)
     Q_PROPERTY(int scaleY READ scaleY NOTIFY scaleYChanged)
+    Q_PROPERTY(QColor lcdBlack READ lcdBlack NOTIFY lcdBlackChanged)
+    Q_PROPERTY(QColor lcdWhite READ lcdWhite NOTIFY lcdWhiteChanged)
 
     Q_PROPERTY(QString name READ name NOTIFY nameChanged)
     Q_PROPERTY(QString author READ author NOTIFY authorChanged)
@@ -88,6 +91,9 @@ public:
         return m_settings.scale().sy;
     }
 
+    QColor lcdBlack() const;
+    QColor lcdWhite() const;
+
     Q_INVOKABLE int keyCode(int x, int y);
     Q_INVOKABLE int getCode(int key);
 
@@ -113,6 +119,9 @@ Q_SIGNALS:
     void scaleXChanged(int);
     void scaleYChanged(int);
 
+    void lcdBlackChanged(QColor);
+    void lcdWhiteChanged(QColor);
+
 public slots:
     void setSkinFile(QString arg);
     void loadSkin();
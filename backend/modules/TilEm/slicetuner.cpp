@@ -0,0 +1,66 @@
+#include "slicetuner.h"
+
+#include "calc.h"
+
+#include <QtGlobal>
+
+SliceTuner::SliceTuner()
+    : m_current(0), m_idle(false)
+{
+}
+
+/**
+ * @brief Length of the next slice
+ *
+ * @param c
+ *
+ * @return slice length in microseconds of emulated time
+ */
+int SliceTuner::next(const Calc *c)
+{
+    const int base = c->sliceLength();
+
+    m_idle = false;
+
+    if ( c->isTurbo() )
+        return m_current = qMax(base, int(TurboSlice));
+
+    if ( c->isIdle() )
+    {
+        m_idle = true;
+        return m_current = c->isPoweredOff() ? OffSlice : IdleSlice;
+    }
+
+    if ( !c->isAutoSlice() )
+        return m_current = base;
+
+    // keep the per-slice overhead under 2% of the slice
+    const int floor = qBound(int(MinSlice), int(c->sliceOverhead() * 50), base);
+
+    if ( c->isBusy() )
+        m_current = floor;
+    else
+        m_current = qBound(floor, m_current * 2, base);
+
+    return m_current;
+}
+
+/**
+ * @brief Length of the last slice handed out
+ *
+ * @return
+ */
+int SliceTuner::current() const
+{
+    return m_current;
+}
+
+/**
+ * @brief Whether the last slice handed out is an idle one
+ *
+ * @return
+ */
+bool SliceTuner::isIdle() const
+{
+    return m_idle;
+}
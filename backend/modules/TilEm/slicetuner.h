@@ -0,0 +1,43 @@
+#ifndef SLICETUNER_H
+#define SLICETUNER_H
+
+class Calc;
+
+/*!
+    \class SliceTuner
+    \brief Picks the length of the next slice of emulated time for a calc
+
+    Short slices mean low input and link latency, long ones amortize the
+    fixed cost of every run (link pump, locking, snapshot, pacing). With
+    Calc::isAutoSlice() the tuner drops to short slices as soon as the
+    link or the keypad is busy and grows back to Calc::sliceLength() once
+    things calm down. It never goes below what keeps the measured overhead
+    (see Calc::sliceOverhead()) under a few percent. Turbo and idle calcs
+    always get long slices.
+*/
+class SliceTuner
+{
+    public:
+        enum
+        {
+            MinSlice = 1000,
+            TurboSlice = 100000,
+
+            // halted CPU : the core skips straight to the next timer event, so bigger slices are cheap
+            IdleSlice = 50000,
+            OffSlice = 1000000
+        };
+
+        SliceTuner();
+
+        int next(const Calc *c);
+
+        int current() const;
+        bool isIdle() const;
+
+    private:
+        int m_current;
+        bool m_idle;
+};
+
+#endif // SLICETUNER_H
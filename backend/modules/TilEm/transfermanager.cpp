@@ -0,0 +1,248 @@
+#include "transfermanager.h"
+
+#include "calc.h"
+#include "calclink.h"
+#include "linktransfer.h"
+
+Q_GLOBAL_STATIC(TransferManager, globalManager)
+
+TransferManager::TransferManager(QObject *p)
+ : QObject(p), m_active(0)
+{
+}
+
+TransferManager::~TransferManager()
+{
+    cancelAll();
+}
+
+/**
+ * @brief Process wide manager, the one QML sees
+ *
+ * @return
+ */
+TransferManager* TransferManager::instance()
+{
+    return globalManager();
+}
+
+/**
+ * @brief Transfers started since the last clearFinished(), oldest first
+ *
+ * @return LinkTransfer objects
+ */
+QList<QObject*> TransferManager::transfers() const
+{
+    QList<QObject*> l;
+
+    foreach ( LinkTransfer *t, m_transfers )
+        l << t;
+
+    return l;
+}
+
+/**
+ * @brief Number of transfers queued or running
+ *
+ * @return
+ */
+int TransferManager::activeCount() const
+{
+    return m_active;
+}
+
+/**
+ * @brief Bytes moved by all transfers, failed and cancelled ones aside
+ *
+ * @return
+ */
+qint64 TransferManager::bytesDone() const
+{
+    qint64 n = 0;
+
+    foreach ( LinkTransfer *t, m_transfers )
+    {
+        const LinkTransfer::State s = t->state();
+
+        if ( s == LinkTransfer::Done )
+            n += t->bytesTotal();
+        else if ( s != LinkTransfer::Failed && s != LinkTransfer::Cancelled )
+            n += qMin(t->bytesDone(), t->bytesTotal());
+    }
+
+    return n;
+}
+
+/**
+ * @brief Bytes to move by all transfers, failed and cancelled ones aside
+ *
+ * @return
+ */
+qint64 TransferManager::bytesTotal() const
+{
+    qint64 n = 0;
+
+    foreach ( LinkTransfer *t, m_transfers )
+    {
+        const LinkTransfer::State s = t->state();
+
+        if ( s != LinkTransfer::Failed && s != LinkTransfer::Cancelled )
+            n += t->bytesTotal();
+    }
+
+    return n;
+}
+
+/**
+ * @brief Progress of the whole batch
+ *
+ * @return Between 0 and 1
+ */
+qreal TransferManager::progress() const
+{
+    const qint64 total = bytesTotal();
+
+    return total > 0 ? qreal(bytesDone()) / total : (m_active ? 0. : 1.);
+}
+
+/**
+ * @brief Combined speed of the running transfers
+ *
+ * @return bytes per second of host time
+ */
+qreal TransferManager::throughput() const
+{
+    qreal r = 0;
+
+    foreach ( LinkTransfer *t, m_transfers )
+        if ( t->state() == LinkTransfer::Running )
+            r += t->throughput();
+
+    return r;
+}
+
+/**
+ * @brief Queue a file for a calc
+ *
+ * @param c
+ * @param file
+ *
+ * @return The transfer, owned by the manager until clearFinished(), 0 if the calc has no link
+ */
+LinkTransfer* TransferManager::send(Calc *c, const QString& file)
+{
+    if ( !c || !c->link() )
+        return 0;
+
+    return add(new LinkTransfer(c, file, this));
+}
+
+/**
+ * @brief Queue a dump of a calc into a directory, see LinkTransfer
+ *
+ * Queued after the transfers already queued for the same calc, e.g. the
+ * files it has to run first.
+ *
+ * @param c
+ * @param directory
+ * @param contents LinkTransfer::Content flags
+ * @param filter Wildcard matched against file names, e.g. "*.8xp" for programs
+ *
+ * @return The transfer, owned by the manager until clearFinished(), 0 if the calc has no link
+ */
+LinkTransfer* TransferManager::receive(Calc *c, const QString& directory, int contents, const QString& filter)
+{
+    if ( !c || !c->link() )
+        return 0;
+
+    return add(new LinkTransfer(c, directory, contents, filter, this));
+}
+
+LinkTransfer* TransferManager::add(LinkTransfer *t)
+{
+    connect(t, SIGNAL( finished() ), this, SLOT( transferDone() ));
+    connect(t, SIGNAL( progressChanged() ), this, SIGNAL( progressChanged() ));
+
+    m_transfers << t;
+    ++m_active;
+
+    t->calc()->link()->queue(t);
+
+    emit transfersChanged();
+    emit activeCountChanged(m_active);
+    emit progressChanged();
+
+    return t;
+}
+
+/**
+ * @brief Queue several files for a calc, sent in that order
+ *
+ * @param c
+ * @param files
+ *
+ * @return LinkTransfer objects
+ */
+QList<QObject*> TransferManager::sendFiles(Calc *c, const QStringList& files)
+{
+    QList<QObject*> l;
+
+    foreach ( const QString& file, files )
+        if ( LinkTransfer *t = send(c, file) )
+            l << t;
+
+    return l;
+}
+
+/**
+ * @brief Cancel every transfer that is not over yet
+ */
+void TransferManager::cancelAll()
+{
+    foreach ( LinkTransfer *t, m_transfers )
+        t->cancel();
+}
+
+/**
+ * @brief Forget the transfers that are over, i.e. whose finished() was delivered
+ */
+void TransferManager::clearFinished()
+{
+    bool changed = false;
+
+    for ( int i = m_transfers.count() - 1; i >= 0; --i )
+    {
+        LinkTransfer *t = m_transfers.at(i);
+
+        // isFinished() may already hold while the link thread is still finishing it up
+        if ( !m_finished.contains(t) )
+            continue;
+
+        m_transfers.removeAt(i);
+        m_finished.remove(t);
+        t->deleteLater();
+        changed = true;
+    }
+
+    if ( changed )
+    {
+        emit transfersChanged();
+        emit progressChanged();
+    }
+}
+
+void TransferManager::transferDone()
+{
+    LinkTransfer *t = qobject_cast<LinkTransfer*>(sender());
+
+    if ( !t || !m_transfers.contains(t) || m_finished.contains(t) )
+        return;
+
+    m_finished.insert(t);
+
+    m_active = m_transfers.count() - m_finished.count();
+    emit activeCountChanged(m_active);
+
+    emit progressChanged();
+    emit transferFinished(t);
+}
@@ -0,0 +1,73 @@
+#ifndef TRANSFERMANAGER_H
+#define TRANSFERMANAGER_H
+
+#include <QObject>
+#include <QList>
+#include <QSet>
+#include <QStringList>
+
+#include "linktransfer.h"
+
+/*!
+    \class TransferManager
+    \brief Batch file transfers to and from any number of calcs, for QML
+
+    Every transfer goes to the CalcLink of its calc, which has its own queue
+    and link thread : transfers for one calc run in order, different calcs
+    are served concurrently. The manager keeps the transfers it
+    started until clearFinished() and sums their progress up, so a single
+    progress bar can follow a whole batch. Each LinkTransfer can be
+    cancelled on its own.
+
+    Must be used from the GUI thread. Exposed to QML as a singleton.
+*/
+class TransferManager : public QObject
+{
+    Q_OBJECT
+        Q_PROPERTY(QList<QObject*> transfers READ transfers NOTIFY transfersChanged)
+        Q_PROPERTY(int activeCount READ activeCount NOTIFY activeCountChanged)
+        Q_PROPERTY(qint64 bytesDone READ bytesDone NOTIFY progressChanged)
+        Q_PROPERTY(qint64 bytesTotal READ bytesTotal NOTIFY progressChanged)
+        Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged)
+        Q_PROPERTY(qreal throughput READ throughput NOTIFY progressChanged)
+
+    public:
+        TransferManager(QObject *p = 0);
+        ~TransferManager();
+
+        static TransferManager* instance();
+
+        QList<QObject*> transfers() const;
+        int activeCount() const;
+
+        qint64 bytesDone() const;
+        qint64 bytesTotal() const;
+        qreal progress() const;
+        qreal throughput() const;
+
+        Q_INVOKABLE LinkTransfer* send(Calc *c, const QString& file);
+        Q_INVOKABLE QList<QObject*> sendFiles(Calc *c, const QStringList& files);
+        Q_INVOKABLE LinkTransfer* receive(Calc *c, const QString& directory, int contents = LinkTransfer::Variables, const QString& filter = "*");
+
+    public slots:
+        void cancelAll();
+        void clearFinished();
+
+    Q_SIGNALS:
+        void transfersChanged();
+        void activeCountChanged(int n);
+        void progressChanged();
+        void transferFinished(LinkTransfer *t);
+
+    private slots:
+        void transferDone();
+
+    private:
+        LinkTransfer* add(LinkTransfer *t);
+
+        QList<LinkTransfer*> m_transfers;
+        QSet<LinkTransfer*> m_finished;
+        int m_active;
+};
+
+#endif // TRANSFERMANAGER_H
@@ -0,0 +1,456 @@
+#include "varinjector.h"
+
+#include <QObject>
+
+/*
+    TI-83+ OS entry points and RAM locations, see ti83plus.inc
+*/
+enum
+{
+    OP1 = 0x8478,
+    Flags = 0x89F0,
+    AppBackUpScreen = 0x9872,
+
+    // loader : OP1 image, where the new data goes, then code
+    StubResult = AppBackUpScreen + 9,
+    StubCode = AppBackUpScreen + 16,
+    StubSize = 96,
+
+    // error handler frames, see the AppOnErr / AppOffErr macros
+    APP_PUSH_ERRORH = 0x0059,
+    APP_POP_ERRORH = 0x005C,
+
+    _ChkFindSym = 0x42F1,
+    _EnoughMem = 0x42FD,
+    _DelVarArc = 0x4FC6,
+    _Arc_Unarc = 0x4FD8,
+
+    _CreateReal = 0x430F,
+    _CreateCplx = 0x430C,
+    _CreateRList = 0x431B,
+    _CreateCList = 0x432A,
+    _CreateRMat = 0x4321,
+    _CreateStrng = 0x4327,
+    _CreateEqu = 0x4330,
+    _CreatePict = 0x4333,
+    _CreateProg = 0x4339,
+    _CreateProtProg = 0x4E6D,
+    _CreateAppVar = 0x4E6A,
+
+    // VAT entry and slack on top of the data
+    VatOverhead = 16,
+
+    // creating even a large variable moves at most the whole user RAM
+    StubBudget = 2000000,
+
+    // flash writes are slow, a garbage collection (and its prompt) is not waited for
+    ArchiveBudget = 20000000,
+
+    StubChunk = 1000
+};
+
+static int data_word(const QByteArray& d, int offset)
+{
+    return quint8(d.at(offset)) | (quint8(d.at(offset + 1)) << 8);
+}
+
+/*
+    Which bcall creates a variable of a given type, what it expects in HL
+    and how many bytes its data takes, from the data itself.
+
+    Returns false if the type is not handled or the data is inconsistent.
+*/
+static bool var_layout(const VarInjector::Var& v, int *bcall, int *arg, int *size)
+{
+    const QByteArray& d = v.data;
+
+    *arg = 0;
+
+    switch ( v.type )
+    {
+        case VarInjector::Real:
+            *bcall = _CreateReal;
+            *size = 9;
+            break;
+
+        case VarInjector::Complex:
+            *bcall = _CreateCplx;
+            *size = 18;
+            break;
+
+        case VarInjector::RealList:
+        case VarInjector::ComplexList:
+            if ( d.size() < 2 )
+                return false;
+
+            *bcall = v.type == VarInjector::RealList ? _CreateRList : _CreateCList;
+            *arg = data_word(d, 0);
+            *size = 2 + *arg * (v.type == VarInjector::RealList ? 9 : 18);
+            break;
+
+        case VarInjector::Matrix:
+            if ( d.size() < 2 )
+                return false;
+
+            // columns then rows, HL wants rows in H and columns in L
+            *bcall = _CreateRMat;
+            *arg = data_word(d, 0);
+            *size = 2 + quint8(d.at(0)) * quint8(d.at(1)) * 9;
+            break;
+
+        case VarInjector::Equation:
+        case VarInjector::String:
+        case VarInjector::Program:
+        case VarInjector::ProtectedProgram:
+        case VarInjector::AppVar:
+            if ( d.size() < 2 )
+                return false;
+
+            *bcall =
+                v.type == VarInjector::Equation ? _CreateEqu :
+                v.type == VarInjector::String ? _CreateStrng :
+                v.type == VarInjector::Program ? _CreateProg :
+                v.type == VarInjector::ProtectedProgram ? _CreateProtProg :
+                _CreateAppVar;
+
+            *arg = data_word(d, 0);
+            *size = 2 + *arg;
+            break;
+
+        case VarInjector::Picture:
+            if ( d.size() < 2 || data_word(d, 0) != 756 )
+                return false;
+
+            *bcall = _CreatePict;
+            *size = 2 + 756;
+            break;
+
+        default:
+            return false;
+    }
+
+    return d.size() >= *size;
+}
+
+static void put_word(QByteArray& code, int w)
+{
+    code += char(w & 0xff);
+    code += char((w >> 8) & 0xff);
+}
+
+static void put_bcall(QByteArray& code, int bcall)
+{
+    // rst 28h
+    code += char(0xEF);
+    put_word(code, bcall);
+}
+
+static void put_call(QByteArray& code, int addr)
+{
+    code += char(0xCD);
+    put_word(code, addr);
+}
+
+/*
+    Have OS errors (ERR:MEMORY, ERR:ARCHIVED...) jump to a handler rather
+    than to the error screen. The handler address is patched in later, at
+    the returned offset.
+*/
+static int put_push_error_handler(QByteArray& code)
+{
+    // ld hl, handler ; call APP_PUSH_ERRORH
+    code += char(0x21);
+    const int patch = code.size();
+    put_word(code, 0);
+    put_call(code, APP_PUSH_ERRORH);
+
+    return patch;
+}
+
+static void patch_word(QByteArray& code, int offset, int w)
+{
+    code[offset] = char(w & 0xff);
+    code[offset + 1] = char((w >> 8) & 0xff);
+}
+
+static void put_load_op1(QByteArray& code)
+{
+    // ld hl, name ; ld de, OP1 ; ld bc, 9 ; ldir
+    code += char(0x21);
+    put_word(code, AppBackUpScreen);
+    code += char(0x11);
+    put_word(code, OP1);
+    code += char(0x01);
+    put_word(code, 9);
+    code += char(0xED);
+    code += char(0xB0);
+}
+
+/*
+    Address of the next instruction to be emitted
+*/
+static int stub_pc(const QByteArray& code)
+{
+    return StubCode + code.size();
+}
+
+static void put_halt_loop(QByteArray& code)
+{
+    // jr $
+    code += char(0x18);
+    code += char(0xFE);
+}
+
+/*
+    Run the loader until the CPU spins at one of the two final loops
+*/
+static bool run_stub(TilemCalc *calc, const QByteArray& op1, const QByteArray& code, int done, int fail, int budget)
+{
+    Q_ASSERT(StubCode + code.size() <= AppBackUpScreen + StubSize);
+
+    for ( int i = 0; i < op1.size(); ++i )
+        calc->hw.z80_wrmem(calc, AppBackUpScreen + i, op1.at(i));
+
+    for ( int i = 0; i < code.size(); ++i )
+        calc->hw.z80_wrmem(calc, StubCode + i, code.at(i));
+
+    calc->z80.r.pc.w.l = StubCode;
+    calc->z80.r.iy.w.l = Flags;
+    calc->z80.r.iff1 = calc->z80.r.iff2 = 0;
+    calc->z80.halted = 0;
+
+    for ( int spent = 0; spent < budget; spent += StubChunk )
+    {
+        int remaining;
+
+        tilem_z80_run(calc, StubChunk, &remaining);
+
+        const int pc = calc->z80.r.pc.w.l;
+
+        if ( pc == done )
+            return true;
+
+        if ( pc == fail )
+            return false;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Whether the calc model can take injected variables at all
+ *
+ * @param calc
+ *
+ * @return
+ */
+bool VarInjector::isSupported(TilemCalc *calc)
+{
+    if ( !calc )
+        return false;
+
+    switch ( calc->hw.model_id )
+    {
+        case TILEM_CALC_TI83P:
+        case TILEM_CALC_TI83P_SE:
+        case TILEM_CALC_TI84P:
+        case TILEM_CALC_TI84P_SE:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Whether the OS is idle, i.e. waiting for a key with interrupts on
+ *
+ * The loader only runs then : anything else may be in the middle of using
+ * the very VAT, memory or scratch RAM it works with.
+ *
+ * @param calc
+ *
+ * @return
+ */
+bool VarInjector::isIdle(TilemCalc *calc)
+{
+    return calc && calc->z80.halted && calc->z80.r.iff1;
+}
+
+/**
+ * @brief Whether variables of a given type can be injected into a calc
+ *
+ * @param calc
+ * @param type
+ *
+ * @return
+ */
+bool VarInjector::isSupported(TilemCalc *calc, int type)
+{
+    switch ( type )
+    {
+        case Real:
+        case RealList:
+        case Matrix:
+        case Equation:
+        case String:
+        case Program:
+        case ProtectedProgram:
+        case Picture:
+        case Complex:
+        case ComplexList:
+        case AppVar:
+            return isSupported(calc);
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Create (or replace) a variable, synchronously
+ *
+ * Must be called from the thread that owns the emulation, i.e. with the
+ * run lock of the Calc held, while the OS is idle (see isIdle()). The core
+ * runs for a few thousand cycles, more when archiving. Free memory is
+ * checked before any previous copy is deleted, which is then kept when
+ * memory is short even if deleting it would have made room.
+ *
+ * @param calc
+ * @param var
+ * @param error Set to a readable message on failure
+ *
+ * @return
+ */
+bool VarInjector::inject(TilemCalc *calc, const Var& var, QString *error)
+{
+    int bcall, arg, size;
+
+    if ( !isSupported(calc, var.type) || var.name.isEmpty() || var.name.size() > 8 )
+    {
+        if ( error )
+            *error = QObject::tr("variable type %1 cannot be injected").arg(var.type);
+
+        return false;
+    }
+
+    if ( !var_layout(var, &bcall, &arg, &size) )
+    {
+        if ( error )
+            *error = QObject::tr("inconsistent variable data");
+
+        return false;
+    }
+
+    if ( !isIdle(calc) )
+    {
+        if ( error )
+            *error = QObject::tr("the calc is busy");
+
+        return false;
+    }
+
+    // type and zero padded name, as _ChkFindSym wants it in OP1
+    QByteArray op1(9, 0);
+    op1[0] = char(var.type);
+
+    for ( int i = 0; i < var.name.size(); ++i )
+        op1[1 + i] = var.name.at(i);
+
+    // keep what the running program sees
+    const TilemZ80Regs regs = calc->z80.r;
+    const int halted = calc->z80.halted;
+
+    QByteArray scratch(StubSize, 0);
+
+    for ( int i = 0; i < StubSize; ++i )
+        scratch[i] = char(calc->hw.z80_rdmem(calc, AppBackUpScreen + i));
+
+    // any OS error ends up at fail, with its handler frame popped
+    QByteArray code;
+    int handler = put_push_error_handler(code);
+
+    // check memory before anything is deleted
+    code += char(0x21);
+    put_word(code, qMin(size + VatOverhead, 0xFFFF));
+    put_bcall(code, _EnoughMem);
+
+    const int jrNoMem = code.size();
+    code += char(0x38);
+    code += char(0);
+
+    // delete any previous copy, in RAM or archive
+    put_load_op1(code);
+    put_bcall(code, _ChkFindSym);
+    code += char(0x38);
+    code += char(3);
+    put_bcall(code, _DelVarArc);
+
+    // the deletion may have used OP1
+    put_load_op1(code);
+
+    code += char(0x21);
+    put_word(code, arg);
+    put_bcall(code, bcall);
+
+    // ld (StubResult), de : where the data goes, popping the frame may clobber DE
+    code += char(0xED);
+    code += char(0x53);
+    put_word(code, StubResult);
+
+    put_call(code, APP_POP_ERRORH);
+
+    int done = stub_pc(code);
+    put_halt_loop(code);
+
+    code[jrNoMem + 1] = char(stub_pc(code) - (StubCode + jrNoMem + 2));
+    put_call(code, APP_POP_ERRORH);
+
+    int fail = stub_pc(code);
+    put_halt_loop(code);
+
+    patch_word(code, handler, fail);
+
+    bool ok = run_stub(calc, op1, code, done, fail, StubBudget);
+
+    if ( ok )
+    {
+        // the OS created the entry, fill it in where it says
+        const int de = calc->hw.z80_rdmem(calc, StubResult) | (calc->hw.z80_rdmem(calc, StubResult + 1) << 8);
+
+        for ( int i = 0; i < size; ++i )
+            calc->hw.z80_wrmem(calc, (de + i) & 0xFFFF, var.data.at(i));
+
+        if ( var.archived )
+        {
+            code.clear();
+            handler = put_push_error_handler(code);
+            put_load_op1(code);
+            put_bcall(code, _Arc_Unarc);
+            put_call(code, APP_POP_ERRORH);
+
+            done = stub_pc(code);
+            put_halt_loop(code);
+
+            fail = stub_pc(code);
+            put_halt_loop(code);
+
+            patch_word(code, handler, fail);
+
+            ok = run_stub(calc, op1, code, done, fail, ArchiveBudget);
+
+            if ( !ok && error )
+                *error = QObject::tr("unable to archive the variable, it was left in RAM");
+        }
+    } else if ( error ) {
+        *error = QObject::tr("the OS could not create the variable (out of memory ?)");
+    }
+
+    for ( int i = 0; i < StubSize; ++i )
+        calc->hw.z80_wrmem(calc, AppBackUpScreen + i, scratch.at(i));
+
+    calc->z80.r = regs;
+    calc->z80.halted = halted;
+
+    return ok;
+}
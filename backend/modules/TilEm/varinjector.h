@@ -0,0 +1,68 @@
+#ifndef VARINJECTOR_H
+#define VARINJECTOR_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <tilem.h>
+
+/*!
+    \class VarInjector
+    \brief Writes variables straight into the memory of an emulated calc
+
+    Much faster than a link transfer : instead of feeding every byte through
+    the link port, a short loader is written into appBackUpScreen and run by
+    the core. It has the OS check the free memory, look the variable up,
+    delete it and create it anew (bcalls _EnoughMem, _ChkFindSym, _DelVarArc
+    and _CreateXXX), so that the VAT stays consistent. The data is then copied
+    where the OS put it and archived if requested. The loader installs an
+    error handler so that an OS error fails the injection instead of leaving
+    the error screen up. The CPU registers and the scratch RAM used by the
+    loader are restored afterwards.
+
+    Only the TI-83+ / TI-84+ family is supported, and the OS must be up and
+    idle (e.g. at the home screen, see isIdle()). Flash applications are not handled :
+    they have to be signed and written to flash by the OS, which is what a
+    link transfer does.
+*/
+class VarInjector
+{
+    public:
+        // TI-83+ variable types
+        enum Type
+        {
+            Real = 0x00,
+            RealList = 0x01,
+            Matrix = 0x02,
+            Equation = 0x03,
+            String = 0x04,
+            Program = 0x05,
+            ProtectedProgram = 0x06,
+            Picture = 0x07,
+            Complex = 0x0C,
+            ComplexList = 0x0D,
+            AppVar = 0x15
+        };
+
+        struct Var
+        {
+            int type;
+
+            // on-calc name, at most 8 bytes
+            QByteArray name;
+
+            // as in link files : the in-memory image of the variable, size word included
+            QByteArray data;
+
+            bool archived;
+        };
+
+        static bool isSupported(TilemCalc *calc);
+        static bool isSupported(TilemCalc *calc, int type);
+
+        static bool isIdle(TilemCalc *calc);
+
+        static bool inject(TilemCalc *calc, const Var& var, QString *error = 0);
+};
+
+#endif // VARINJECTOR_H